@@ -0,0 +1,75 @@
+#include <titan/titan.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+using namespace std;
+using namespace titan;
+
+// 对比TcpServer三种监听方式的accept速率. 客户端线程不断建立连接, 服务端accept后立即关闭连接,
+// 客户端读到EOF后用SO_LINGER 0关闭, 双方都不进入TIME_WAIT, 避免耗尽端口
+// 用法: accept-bench [single|reuseport|exclusive] [EventLoop个数] [客户端线程数] [秒数]
+
+int main(int argc, const char *argv[]) {
+    string mode = argc > 1 ? argv[1] : "single";
+    int loops = argc > 2 ? atoi(argv[2]) : 4;
+    int clients = argc > 3 ? atoi(argv[3]) : 4;
+    int seconds = argc > 4 ? atoi(argv[4]) : 3;
+    setloglevel("ERROR");
+
+    MultiEventLoops ml(loops);
+    TcpServer::ListenMode lm = mode == "reuseport" ? TcpServer::ReusePort : mode == "exclusive" ? TcpServer::Exclusive : TcpServer::Single;
+    TcpServerPtr svr = TcpServer::startServer(&ml, "127.0.0.1", 2399, lm);
+    exitif(svr == NULL, "start tcp server failed");
+    atomic<long> accepted(0);
+    unique_ptr<atomic<long>[]> perLoop(new atomic<long>[loops]);
+    for (int i = 0; i < loops; i++) {
+        perLoop[i] = 0;
+    }
+    svr->setTcpConnStateCallback([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            accepted++;
+            perLoop[con->getLoop() - &ml.getLoop(0)]++;
+            con->close();
+        }
+    });
+
+    atomic<bool> stop(false);
+    atomic<long> failed(0);
+    vector<thread> ths;
+    Ip4Addr addr("127.0.0.1", 2399);
+    for (int i = 0; i < clients; i++) {
+        ths.emplace_back([&] {
+            struct linger lg = {1, 0};
+            while (!stop) {
+                int fd = socket(AF_INET, SOCK_STREAM, 0);
+                setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof lg);
+                char c;
+                if (connect(fd, (sockaddr *) &addr.getAddr(), sizeof(sockaddr_in)) || read(fd, &c, 1) != 0) {
+                    failed++;
+                }
+                close(fd);
+            }
+        });
+    }
+    long start = 0;
+    int64_t t0 = 0;
+    ml.getLoop(0).runAfter(500, [&] { // 预热之后开始计数
+        start = accepted;
+        t0 = util::steadyMicro();
+    });
+    ml.getLoop(0).runAfter(500 + seconds * 1000, [&] {
+        double rate = (accepted - start) * 1e6 / (util::steadyMicro() - t0);
+        printf("%s loops %d clients %d: %.0f accepts/s, connect failed %ld\n", mode.c_str(), loops, clients, rate, (long) failed);
+        vector<LoopStats::Snapshot> stats = ml.stats();
+        for (int i = 0; i < loops; i++) {
+            printf("  loop %d connections %ld events per wakeup %.1f busy avg %.1fus\n", i, (long) perLoop[i], stats[i].events.avg(), stats[i].busy.avg());
+        }
+        stop = true;
+        ml.exit();
+    });
+    ml.loop();
+    for (auto &th : ths) {
+        th.join();
+    }
+    return 0;
+}
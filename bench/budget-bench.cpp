@@ -0,0 +1,132 @@
+#include <titan/titan.h>
+
+using namespace std;
+using namespace titan;
+
+// 大流量连接(elephant)与小请求连接(mouse)共用一个服务端EventLoop时, 读预算对小请求延迟的影响.
+// elephant不停发送数据, 服务端逐字节处理后丢弃; mouse每次发送64字节并等待回显, 统计往返时间.
+// 服务端, elephant客户端, mouse客户端各自运行在一个线程的EventLoop中. 消息预算大于0时两种连接都发送64字节的LengthCodec消息,
+// 服务端用setTcpConnMsgCallback解码, 消息预算通过TcpServer::setReadBudget设置, 输出一个连接在一次循环中处理的消息数的最大值
+// 用法: budget-bench [读预算字节数, 0不限制] [elephant连接数] [mouse连接数] [秒数] [level|edge] [消息预算, 0不使用codec]
+
+int main(int argc, const char *argv[]) {
+    size_t budget = argc > 1 ? atol(argv[1]) : 65536;
+    int elephants = argc > 2 ? atoi(argv[2]) : 2;
+    int mice = argc > 3 ? atoi(argv[3]) : 50;
+    int secs = argc > 4 ? atoi(argv[4]) : 3;
+    bool edge = argc > 5 && string(argv[5]) == "edge";
+    int msgs = argc > 6 ? atoi(argv[6]) : 0;
+    setloglevel("ERROR");
+
+    EventLoop svrLoop, bigLoop, smallLoop;
+    TcpServerPtr svr = TcpServer::startServer(&svrLoop, "127.0.0.1", 2999);
+    exitif(svr == NULL, "start tcp server failed");
+    svr->setEdgeTriggered(edge);
+    svr->setReadBudget(budget, msgs);
+    long checksum = 0;
+    uint64_t round = 0;
+    TcpConn *roundCon = NULL;
+    int roundMsgs = 0, maxRoundMsgs = 0; // 一个连接在一次循环中处理的消息数, 只在服务端线程中修改
+    if (msgs > 0) {
+        svr->setTcpConnMsgCallback(new LengthCodec, [&](const TcpConnPtr &con, Slice m) {
+            if (m[0] == 'm') {
+                con->sendMsg(m);
+                return;
+            }
+            if (con->getLoop()->iteration() != round || con.get() != roundCon) {
+                round = con->getLoop()->iteration();
+                roundCon = con.get();
+                roundMsgs = 0;
+            }
+            maxRoundMsgs = max(maxRoundMsgs, ++roundMsgs);
+            for (size_t i = 0; i < m.size(); i++) {
+                checksum = checksum * 31 + m[i];
+            }
+        });
+    } else {
+        svr->setTcpConnReadCallback([&](const TcpConnPtr &con) {
+            Buffer &in = con->getInput();
+            if (in.begin()[0] == 'm') {
+                con->send(in);
+                return;
+            }
+            for (size_t i = 0; i < in.size(); i++) { // 模拟解析数据的开销
+                checksum = checksum * 31 + in.begin()[i];
+            }
+            in.clear();
+        });
+    }
+    thread svrThread([&] { svrLoop.loop(); });
+
+    string chunk(256 << 10, 'e');
+    string msg(64, 'm');
+    if (msgs > 0) { // chunk由多条elephant消息组成, mouse消息编码后发送, 回显的长度相同
+        LengthCodec codec;
+        Buffer big, small;
+        for (size_t n = 0; n < chunk.size(); n += 72) {
+            codec.encode(string(64, 'e'), big);
+        }
+        codec.encode(msg, small);
+        chunk.assign(big.data(), big.size());
+        msg.assign(small.data(), small.size());
+    }
+    long sent = 0;
+    vector<TcpConnPtr> cons;
+    for (int i = 0; i < elephants; i++) {
+        TcpConnPtr con = TcpConn::createConnection(&bigLoop, "127.0.0.1", 2999, 3000);
+        auto fill = [&](const TcpConnPtr &con) {
+            while (con->getOutput().empty() && con->getState() == TcpConn::Connected) {
+                con->send(chunk);
+                sent += chunk.size() - con->getOutput().size();
+            }
+        };
+        con->setStateCallback([fill](const TcpConnPtr &con) {
+            if (con->getState() == TcpConn::Connected) {
+                fill(con);
+            }
+        });
+        con->setWriteCallback(fill);
+        cons.push_back(con);
+    }
+    thread bigThread([&] { bigLoop.loop(); });
+
+    Histogram rtt;
+    vector<int64_t> sentAt(mice);
+    for (int i = 0; i < mice; i++) {
+        TcpConnPtr con = TcpConn::createConnection(&smallLoop, "127.0.0.1", 2999, 3000);
+        con->setReadCallback([&, i](const TcpConnPtr &con) {
+            Buffer &in = con->getInput();
+            if (in.size() < msg.size()) {
+                return;
+            }
+            in.consume(msg.size());
+            int64_t now = util::steadyMicro();
+            rtt.add(now - sentAt[i]);
+            sentAt[i] = now;
+            con->send(msg);
+        });
+        con->setStateCallback([&, i](const TcpConnPtr &con) {
+            if (con->getState() == TcpConn::Connected) {
+                sentAt[i] = util::steadyMicro();
+                con->send(msg);
+            }
+        });
+        cons.push_back(con);
+    }
+    smallLoop.runAfter(secs * 1000, [&] { smallLoop.exit(); });
+    smallLoop.loop();
+    bigLoop.exit();
+    bigThread.join();
+    svrLoop.exit();
+    svrThread.join();
+
+    Histogram::Snapshot h = rtt.snapshot();
+    LoopStats::Snapshot st = svrLoop.stats();
+    if (msgs > 0) {
+        printf("msg budget %d: at most %d elephant messages per connection in one iteration\n", msgs, maxRoundMsgs);
+    }
+    printf("budget %zu %s: elephants %.0f MB/s, mouse rtt count %lu avg %.0f p50 %ld p99 %ld p999 %ld max %lu us, reads deferred %lu\n", budget,
+           edge ? "edge" : "level", sent / 1048576.0 / secs, (unsigned long) h.count, h.avg(), (long) h.percentile(0.5), (long) h.percentile(0.99),
+           (long) h.percentile(0.999), (unsigned long) h.max, (unsigned long) st.readsDeferred);
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include <netinet/tcp.h>
+#include <titan/titan.h>
+
+using namespace std;
+using namespace titan;
+
+// 合并发送的效果: 服务端每收到一个请求回复fanout条小消息(每条一次sendMsg), 对比普通模式与corked模式下
+// 每条回复消息的write次数和吞吐. 普通模式下连续的小消息会受Nagle算法与延迟确认影响, nodelay为普通模式加上TCP_NODELAY.
+// 服务端与客户端各自运行在一个线程的EventLoop中
+// close模式检查corked连接回复后立即close()时, 尚未发送的回复在关闭之前全部发出
+// 用法: cork-bench [plain|nodelay|cork|close] [连接数] [每个请求的回复数] [秒数] [消息大小]
+
+int closeCheck(int conns, int fanout, int size) {
+    EventLoop svrLoop, cliLoop;
+    TcpServerPtr svr = TcpServer::startServer(&svrLoop, "127.0.0.1", 2399);
+    exitif(svr == NULL, "start tcp server failed");
+    svr->setCorked(true);
+    string reply(size, 'r');
+    svr->setTcpConnMsgCallback(new LengthCodec, [&](const TcpConnPtr &con, Slice msg) {
+        for (int i = 0; i < fanout; i++) {
+            con->sendMsg(reply);
+        }
+        con->close();
+    });
+    thread th([&] { svrLoop.loop(); });
+
+    string req(size, 'q');
+    int closed = 0, complete = 0;
+    vector<TcpConnPtr> cons;
+    for (int i = 0; i < conns; i++) {
+        TcpConnPtr con = TcpConn::createConnection(&cliLoop, "127.0.0.1", 2399, 3000);
+        con->context<int>() = 0; // 已收到的回复数
+        con->setMsgCallback(new LengthCodec, [](const TcpConnPtr &con, Slice m) { con->context<int>()++; });
+        con->setStateCallback([&](const TcpConnPtr &con) {
+            if (con->getState() == TcpConn::Connected) {
+                con->sendMsg(req);
+            } else if (con->getState() == TcpConn::Closed || con->getState() == TcpConn::Failed) {
+                complete += con->context<int>() == fanout;
+                if (++closed == conns) {
+                    cliLoop.exit();
+                }
+            }
+        });
+        cons.push_back(con);
+    }
+    cliLoop.runAfter(10000, [&] { cliLoop.exit(); });
+    cliLoop.loop();
+    svrLoop.exit();
+    th.join();
+    printf("close conns %d fanout %d size %d: %d of %d connections received all replies\n", conns, fanout, size, complete, conns);
+    return complete == conns ? 0 : 1;
+}
+
+int main(int argc, const char *argv[]) {
+    string mode = argc > 1 ? argv[1] : "cork";
+    int conns = argc > 2 ? atoi(argv[2]) : 10;
+    int fanout = argc > 3 ? atoi(argv[3]) : 8;
+    int secs = argc > 4 ? atoi(argv[4]) : 3;
+    int size = argc > 5 ? atoi(argv[5]) : 32;
+    setloglevel("ERROR");
+    if (mode == "close") {
+        return closeCheck(conns, fanout, size);
+    }
+
+    EventLoop svrLoop, cliLoop;
+    TcpServerPtr svr = TcpServer::startServer(&svrLoop, "127.0.0.1", 2399);
+    exitif(svr == NULL, "start tcp server failed");
+    svr->setCorked(mode == "cork");
+    if (mode == "nodelay") {
+        svr->setTcpConnStateCallback([](const TcpConnPtr &con) {
+            if (con->getState() == TcpConn::Connected) {
+                int one = 1;
+                setsockopt(con->getChannel()->fd(), IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+            }
+        });
+    }
+    string reply(size, 'r');
+    svr->setTcpConnMsgCallback(new LengthCodec, [&](const TcpConnPtr &con, Slice msg) {
+        for (int i = 0; i < fanout; i++) {
+            con->sendMsg(reply);
+        }
+    });
+    thread th([&] { svrLoop.loop(); });
+
+    // 每个连接同时只有一个请求在途
+    string req(size, 'q');
+    long received = 0;
+    int64_t t0 = 0;
+    uint64_t writes0 = 0;
+    vector<TcpConnPtr> cons;
+    for (int i = 0; i < conns; i++) {
+        TcpConnPtr con = TcpConn::createConnection(&cliLoop, "127.0.0.1", 2399, 3000);
+        con->context<int>() = 0; // 当前请求已收到的回复数
+        con->setMsgCallback(new LengthCodec, [&](const TcpConnPtr &con, Slice m) {
+            received++;
+            if (++con->context<int>() == fanout) {
+                con->context<int>() = 0;
+                con->sendMsg(req);
+            }
+        });
+        con->setStateCallback([&](const TcpConnPtr &con) {
+            if (con->getState() == TcpConn::Connected) {
+                if (t0 == 0) {
+                    t0 = util::steadyMicro();
+                    writes0 = svrLoop.stats().writes;
+                }
+                con->sendMsg(req);
+            } else if (con->getState() == TcpConn::Failed) {
+                cliLoop.exit();
+            }
+        });
+        cons.push_back(con);
+    }
+    cliLoop.runAfter(secs * 1000, [&] { cliLoop.exit(); });
+    cliLoop.loop();
+    int64_t used = util::steadyMicro() - t0;
+    uint64_t writes = svrLoop.stats().writes - writes0;
+    svrLoop.exit();
+    th.join();
+    printf("%s conns %d fanout %d size %d: %.0f replies/s, server %.3f writes per reply\n", mode.c_str(), conns, fanout, size, received * 1e6 / used,
+           (double) writes / received);
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include <titan/titan.h>
+#include <titan/coro.h>
+
+using namespace std;
+using namespace titan;
+
+// 对比回调与协程两种写法的echo服务器: 吞吐以及每条消息的内存分配次数. 需要以-std=c++20编译
+// cork为corked连接上的协程服务器, 回复由循环末尾的flushCorked发送后恢复co::drain. 10秒内没有完成时返回1
+// 用法: coro-bench [callback|coro|cork] [连接数] [每个连接的消息数] [消息大小]
+
+static atomic<long> allocs(0);
+
+void *operator new(size_t sz) {
+    allocs.fetch_add(1, memory_order_relaxed);
+    void *p = malloc(sz);
+    if (p == NULL) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+int main(int argc, const char *argv[]) {
+    string mode = argc > 1 ? argv[1] : "coro";
+    int conns = argc > 2 ? atoi(argv[2]) : 10;
+    int count = argc > 3 ? atoi(argv[3]) : 20000;
+    int size = argc > 4 ? atoi(argv[4]) : 64;
+    setloglevel("ERROR");
+
+    EventLoop svrLoop, cliLoop;
+    TcpServerPtr svr = TcpServer::startServer(&svrLoop, "127.0.0.1", 2699);
+    exitif(svr == NULL, "start tcp server failed");
+    if (mode == "coro" || mode == "cork") {
+        svr->setCorked(mode == "cork");
+        co::serve(svr, [](TcpConnPtr con) -> co::CoTask {
+            LengthCodec codec;
+            Slice msg;
+            while (co_await co::readMsg(con, codec, msg)) {
+                codec.encode(msg, con->getOutput());
+                con->sendOutput();
+                co_await co::drain(con);
+            }
+        });
+    } else {
+        svr->setTcpConnMsgCallback(new LengthCodec, [](const TcpConnPtr &con, Slice msg) { con->sendMsg(msg); });
+    }
+    thread th([&] { svrLoop.loop(); });
+
+    // 客户端每个连接同时只有一条消息在途
+    string msg(size, 'x');
+    long total = (long) conns * count, received = 0;
+    long allocStart = 0;
+    int64_t t0 = 0;
+    vector<TcpConnPtr> cons;
+    for (int i = 0; i < conns; i++) {
+        TcpConnPtr con = TcpConn::createConnection(&cliLoop, "127.0.0.1", 2699, 3000);
+        con->setMsgCallback(new LengthCodec, [&](const TcpConnPtr &con, Slice m) {
+            if (++received == total) {
+                cliLoop.exit();
+            } else {
+                con->sendMsg(m);
+            }
+        });
+        con->setStateCallback([&](const TcpConnPtr &con) {
+            if (con->getState() == TcpConn::Connected) {
+                if (t0 == 0) {
+                    allocStart = allocs;
+                    t0 = util::steadyMicro();
+                }
+                con->sendMsg(msg);
+            } else if (con->getState() == TcpConn::Failed) {
+                cliLoop.exit();
+            }
+        });
+        cons.push_back(con);
+    }
+    cliLoop.runAfter(10000, [&] { cliLoop.exit(); });
+    cliLoop.loop();
+    int64_t used = util::steadyMicro() - t0;
+    long allocUsed = allocs - allocStart;
+    svrLoop.exit();
+    th.join();
+    printf("%s conns %d msgs %ld size %d: %.0f msg/s, %.3f allocations per message (client and server)\n", mode.c_str(), conns, received, size,
+           received * 1e6 / used, (double) allocUsed / received);
+    return received >= total ? 0 : 1;
+}
@@ -0,0 +1,69 @@
+#include <titan/titan.h>
+
+using namespace std;
+using namespace titan;
+
+// 对比水平触发与边沿触发下echo每条消息的epoll_ctl次数. 消息大于socket缓冲区时客户端发送会出现部分写入,
+// 水平触发需要打开再关闭可写事件, 边沿触发不需要. 服务端与客户端各自运行在一个线程的EventLoop中
+// 用法: edge-bench [level|edge] [连接数] [秒数] [消息大小]
+
+int main(int argc, const char *argv[]) {
+    string mode = argc > 1 ? argv[1] : "edge";
+    int conns = argc > 2 ? atoi(argv[2]) : 10;
+    int secs = argc > 3 ? atoi(argv[3]) : 3;
+    int size = argc > 4 ? atoi(argv[4]) : 1 << 20;
+    setloglevel("ERROR");
+    bool edge = mode == "edge";
+
+    EventLoop svrLoop, cliLoop;
+    TcpServerPtr svr = TcpServer::startServer(&svrLoop, "127.0.0.1", 2899);
+    exitif(svr == NULL, "start tcp server failed");
+    svr->setEdgeTriggered(edge);
+    svr->setTcpConnReadCallback([](const TcpConnPtr &con) { con->send(con->getInput()); });
+    thread th([&] { svrLoop.loop(); });
+
+    // 每个连接同时只有一条消息在途
+    string msg(size, 'x');
+    long received = 0;
+    int64_t t0 = 0;
+    LoopStats::Snapshot svrStart, cliStart;
+    vector<TcpConnPtr> cons;
+    for (int i = 0; i < conns; i++) {
+        TcpConnPtr con(new TcpConn);
+        con->setEdgeTriggered(edge);
+        con->setReadCallback([&](const TcpConnPtr &con) {
+            Buffer &in = con->getInput();
+            while (in.size() >= (size_t) size) {
+                in.consume(size);
+                received++;
+                con->send(msg);
+            }
+        });
+        con->setStateCallback([&](const TcpConnPtr &con) {
+            if (con->getState() == TcpConn::Connected) {
+                if (t0 == 0) {
+                    t0 = util::steadyMicro();
+                    svrStart = svrLoop.stats();
+                    cliStart = cliLoop.stats();
+                }
+                con->send(msg);
+            } else if (con->getState() == TcpConn::Failed) {
+                cliLoop.exit();
+            }
+        });
+        con->connect(&cliLoop, "127.0.0.1", 2899, 3000, "");
+        cons.push_back(con);
+    }
+    cliLoop.runAfter(secs * 1000, [&] { cliLoop.exit(); });
+    cliLoop.loop();
+    int64_t used = util::steadyMicro() - t0;
+    LoopStats::Snapshot svrEnd = svrLoop.stats(), cliEnd = cliLoop.stats();
+    svrLoop.exit();
+    th.join();
+    exitif(received == 0, "no message echoed");
+    auto perMsg = [&](uint64_t a, uint64_t b) { return double(b - a) / received; };
+    printf("%s conns %d size %d: %.0f msg/s, per message: server %.2f epoll_ctl(MOD) %.2f epoll_wait, client %.2f epoll_ctl(MOD) %.2f epoll_wait\n",
+           mode.c_str(), conns, size, received * 1e6 / used, perMsg(svrStart.pollUpdates, svrEnd.pollUpdates),
+           perMsg(svrStart.iterations, svrEnd.iterations), perMsg(cliStart.pollUpdates, cliEnd.pollUpdates), perMsg(cliStart.iterations, cliEnd.iterations));
+    return 0;
+}
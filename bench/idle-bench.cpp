@@ -0,0 +1,101 @@
+#include <titan/titan.h>
+#include <list>
+
+using namespace std;
+using namespace titan;
+
+// 原先EventLoop中基于std::list的空闲连接实现, 用于对比
+struct ListIdles {
+    struct Node {
+        TcpConnPtr con_;
+        int64_t updated_;
+        TcpCallback cb_;
+    };
+    typedef pair<list<Node> *, list<Node>::iterator> Id;
+    map<int, list<Node>> idleConns_;
+    int64_t sec_ = 0;
+    Id add(int idle, const TcpConnPtr &con, const TcpCallback &cb) {
+        auto &lst = idleConns_[idle];
+        lst.push_back(Node{con, sec_, cb});
+        return Id(&lst, --lst.end());
+    }
+    void update(Id &id) {
+        id.second->updated_ = sec_;
+        id.first->splice(id.first->end(), *id.first, id.second);
+    }
+    void remove(Id &id) { id.first->erase(id.second); }
+    void call() {
+        for (auto &l : idleConns_) {
+            int idle = l.first;
+            auto lst = l.second;
+            while (lst.size()) {
+                Node &node = lst.front();
+                if (node.updated_ + idle > sec_) {
+                    break;
+                }
+                node.updated_ = sec_;
+                lst.splice(lst.end(), lst, lst.begin());
+                node.cb_(node.con_);
+            }
+        }
+    }
+};
+
+struct BucketIdles {
+    EventLoop loop_;
+    IdleId add(int idle, const TcpConnPtr &con, const TcpCallback &cb) { return loop_.registerIdle(idle, con, cb); }
+    void update(IdleId &id) { loop_.updateIdle(id); }
+    void remove(IdleId &id) { loop_.unregisterIdle(id); }
+    void setSec(int64_t sec) { loop_.nowMicro_ = sec * 1000 * 1000; }
+    void call() { loop_.callIdles(); }
+};
+
+// n个连接, idle为30秒, 每秒有active比例的连接有活动, 模拟运行seconds秒, 统计每秒的CPU时间
+template <class T>
+void run(const char *name, T &idles, vector<TcpConnPtr> &conns, double active, int seconds, int64_t base, function<void(int64_t)> setSec) {
+    long expired = 0;
+    TcpCallback cb = [&expired](const TcpConnPtr &) { expired++; };
+    setSec(base);
+    vector<decltype(idles.add(0, conns[0], cb))> ids;
+    ids.reserve(conns.size());
+    for (auto &con : conns) {
+        ids.push_back(idles.add(30, con, cb));
+    }
+    int step = active > 0 ? int(1 / active) : 0;
+    int64_t used = 0;
+    for (int s = 1; s <= seconds; s++) {
+        setSec(base + s);
+        int64_t t0 = util::steadyMicro();
+        for (size_t i = step ? s % step : ids.size(); i < ids.size(); i += step) {
+            idles.update(ids[i]);
+        }
+        idles.call();
+        used += util::steadyMicro() - t0;
+    }
+    printf("%-7s %8zu conns %3.0f%% active: %8.2f ms cpu per second, %ld expired\n", name, conns.size(), active * 100, used / 1000.0 / seconds, expired);
+    for (auto &id : ids) {
+        idles.remove(id);
+    }
+}
+
+int main(int argc, const char *argv[]) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 90;
+    for (int n : {100 * 1000, 1000 * 1000}) {
+        vector<TcpConnPtr> conns;
+        for (int i = 0; i < n; i++) {
+            conns.push_back(TcpConnPtr(new TcpConn));
+        }
+        for (double active : {0.0, 0.1}) {
+            {
+                ListIdles old;
+                run("list", old, conns, active, seconds, 0, [&old](int64_t sec) { old.sec_ = sec; });
+            }
+            {
+                BucketIdles b;
+                int64_t base = b.loop_.now() / 1000;
+                run("bucket", b, conns, active, seconds, base, [&b](int64_t sec) { b.setSec(sec); });
+            }
+        }
+    }
+    return 0;
+}
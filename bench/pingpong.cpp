@@ -0,0 +1,64 @@
+#include <titan/titan.h>
+#include <algorithm>
+
+using namespace std;
+using namespace titan;
+
+// 回环地址上的ping-pong延迟, 对比阻塞模式与忙轮询模式. 服务端与客户端各自运行在一个线程的EventLoop中
+// 用法: pingpong [spin预算(微秒), 0表示阻塞] [往返次数] [消息大小]
+
+int main(int argc, const char *argv[]) {
+    int64_t budget = argc > 1 ? atoi(argv[1]) : 0;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20000;
+    int size = argc > 3 ? atoi(argv[3]) : 64;
+    setloglevel("ERROR");
+
+    EventLoop svrLoop, cliLoop;
+    svrLoop.setBusyPoll(budget);
+    cliLoop.setBusyPoll(budget);
+    TcpServerPtr svr = TcpServer::startServer(&svrLoop, "127.0.0.1", 2199);
+    exitif(svr == NULL, "start tcp server failed");
+    svr->setTcpConnReadCallback([](const TcpConnPtr &con) { con->send(con->getInput()); });
+    thread th([&] { svrLoop.loop(); });
+
+    string msg(size, 'x');
+    vector<int64_t> rtts;
+    rtts.reserve(rounds);
+    int64_t sent = 0;
+    TcpConnPtr con = TcpConn::createConnection(&cliLoop, "127.0.0.1", 2199, 3000);
+    con->setStateCallback([&](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            sent = util::steadyMicro();
+            con->send(msg);
+        } else if (con->getState() == TcpConn::Failed) {
+            cliLoop.exit();
+        }
+    });
+    con->setReadCallback([&](const TcpConnPtr &con) {
+        Buffer &in = con->getInput();
+        while (in.size() >= (size_t) size) {
+            in.consume(size);
+            int64_t now = util::steadyMicro();
+            rtts.push_back(now - sent);
+            if ((int) rtts.size() == rounds) {
+                cliLoop.exit();
+                return;
+            }
+            sent = now;
+            con->send(msg);
+        }
+    });
+    int64_t t0 = util::steadyMicro();
+    cliLoop.loop();
+    int64_t used = util::steadyMicro() - t0;
+    svrLoop.exit();
+    th.join();
+
+    exitif(rtts.empty(), "no round trip finished");
+    sort(rtts.begin(), rtts.end());
+    auto pct = [&](double p) { return rtts[min(rtts.size() - 1, size_t(p * rtts.size()))]; };
+    printf("%s budget %ldus rounds %zu size %d: p50 %ldus p99 %ldus max %ldus, %.0f rt/s\n", budget ? "spin" : "block", (long) budget,
+           rtts.size(), size, (long) pct(0.5), (long) pct(0.99), (long) rtts.back(), rtts.size() * 1e6 / used);
+    printf("client loop budget now %ldus, %s\n", (long) cliLoop.busyPollBudget(), cliLoop.stats().toString().c_str());
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include <titan/titan.h>
+
+using namespace std;
+using namespace titan;
+
+// 对比epoll与io_uring两种poller下echo服务器和HTTP服务器(keep-alive)的吞吐. 服务端与客户端各自运行在一个线程的EventLoop中,
+// 使用同一种poller. 每个连接同时只有一条消息或者一个请求在途
+// 用法: poller-bench [epoll|uring] [echo|http] [连接数] [秒数] [消息大小]
+
+int main(int argc, const char *argv[]) {
+    string name = argc > 1 ? argv[1] : "uring";
+    bool http = argc > 2 && string(argv[2]) == "http";
+    int conns = argc > 3 ? atoi(argv[3]) : 100;
+    int secs = argc > 4 ? atoi(argv[4]) : 3;
+    int size = argc > 5 ? atoi(argv[5]) : 64;
+    setloglevel("ERROR");
+    PollerType type = name == "epoll" ? PollerType::Epoll : PollerType::Uring;
+
+    EventLoop svrLoop, cliLoop;
+    exitif(!svrLoop.setPoller(type) || !cliLoop.setPoller(type), "poller %s unavailable", name.c_str());
+    TcpServerPtr svr;
+    HttpServer hsvr(&svrLoop);
+    string body(size, 'x');
+    if (http) {
+        exitif(hsvr.bind("127.0.0.1", 2799), "start http server failed");
+        hsvr.setGetCallback("/", [&](const HttpConnPtr &con) {
+            HttpResponse resp;
+            resp.body = Slice(body);
+            con.sendResponse(resp);
+        });
+    } else {
+        svr = TcpServer::startServer(&svrLoop, "127.0.0.1", 2799);
+        exitif(svr == NULL, "start tcp server failed");
+        svr->setTcpConnReadCallback([](const TcpConnPtr &con) { con->send(con->getInput()); });
+    }
+    thread th([&] { svrLoop.loop(); });
+
+    // echo的响应与消息等长, HTTP的响应以body结尾
+    string msg = http ? "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n" : string(size, 'x');
+    long received = 0;
+    int64_t t0 = 0;
+    vector<TcpConnPtr> cons;
+    for (int i = 0; i < conns; i++) {
+        TcpConnPtr con = TcpConn::createConnection(&cliLoop, "127.0.0.1", 2799, 3000);
+        con->setReadCallback([&](const TcpConnPtr &con) {
+            Buffer &in = con->getInput();
+            if (http) {
+                if (in.size() >= body.size() && memcmp(in.end() - body.size(), body.data(), body.size()) == 0 && memmem(in.data(), in.size(), "\r\n\r\n", 4)) {
+                    in.clear();
+                    received++;
+                    con->send(msg);
+                }
+                return;
+            }
+            while (in.size() >= (size_t) size) {
+                in.consume(size);
+                received++;
+                con->send(msg);
+            }
+        });
+        con->setStateCallback([&](const TcpConnPtr &con) {
+            if (con->getState() == TcpConn::Connected) {
+                if (t0 == 0) {
+                    t0 = util::steadyMicro();
+                }
+                con->send(msg);
+            } else if (con->getState() == TcpConn::Failed) {
+                cliLoop.exit();
+            }
+        });
+        cons.push_back(con);
+    }
+    cliLoop.runAfter(secs * 1000, [&] { cliLoop.exit(); });
+    cliLoop.loop();
+    int64_t used = util::steadyMicro() - t0;
+    svrLoop.exit();
+    th.join();
+    LoopStats::Snapshot st = svrLoop.stats();
+    printf("%s %s conns %d size %d: %.0f msg/s, server %.1f events per iteration\n", name.c_str(), http ? "http" : "echo", conns, size, received * 1e6 / used,
+           st.events.avg());
+    return 0;
+}
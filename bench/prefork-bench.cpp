@@ -0,0 +1,110 @@
+#include <sys/wait.h>
+#include <titan/titan.h>
+
+using namespace std;
+using namespace titan;
+
+// HTTP keep-alive吞吐: 服务端为单进程多线程(MultiEventLoops)或者多进程(Prefork, 每个worker一个线程), 运行在子进程中.
+// 客户端的每个连接同时只有一个请求在途, 连接被关闭时计为失败并重连. crash为1时在一半时间处请求/crash, 处理该请求的进程abort,
+// 多进程模式下只影响一个worker, 由supervisor重启
+// 用法: prefork-bench [threads|procs] [线程数或进程数] [连接数] [秒数] [crash]
+
+const unsigned short kPort = 2699;
+
+static void runServer(bool procs, int n) {
+    auto setup = [](HttpServer &svr) {
+        svr.setGetCallback("/hello", [](const HttpConnPtr &con) {
+            HttpResponse resp;
+            resp.body = Slice("hello world");
+            con.sendResponse(resp);
+        });
+        svr.setGetCallback("/crash", [](const HttpConnPtr &con) { abort(); });
+    };
+    if (procs) {
+        Prefork pf(n);
+        exitif(pf.bind("127.0.0.1", kPort), "bind failed");
+        pf.run([&](int index, const vector<int> &fds) {
+            EventLoop loop;
+            HttpServer svr(&loop);
+            exitif(svr.adopt(fds[0]), "adopt failed");
+            setup(svr);
+            Signal::signal(SIGTERM, [&] { loop.exit(); });
+            loop.loop();
+        });
+        return;
+    }
+    MultiEventLoops loops(n);
+    HttpServer svr(&loops);
+    exitif(svr.bind("127.0.0.1", kPort), "bind failed");
+    setup(svr);
+    Signal::signal(SIGTERM, [&] { loops.exit(); });
+    loops.loop();
+}
+
+int main(int argc, const char *argv[]) {
+    bool procs = argc > 1 && string(argv[1]) == "procs";
+    int n = argc > 2 ? atoi(argv[2]) : 4;
+    int conns = argc > 3 ? atoi(argv[3]) : 64;
+    int secs = argc > 4 ? atoi(argv[4]) : 3;
+    bool crash = argc > 5 && atoi(argv[5]);
+    setloglevel("ERROR");
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t server = fork();
+    exitif(server < 0, "fork failed");
+    if (server == 0) {
+        runServer(procs, n);
+        return 0;
+    }
+    usleep(300 * 1000); // 等待服务端开始监听
+
+    EventLoop loop;
+    string req = "GET /hello HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+    long ok = 0, failed = 0;
+    bool stopping = false;
+    function<void()> connect = [&] {
+        TcpConnPtr con = TcpConn::createConnection(&loop, "127.0.0.1", kPort, 1000);
+        con->setReadCallback([&](const TcpConnPtr &con) {
+            Buffer &in = con->getInput();
+            if (in.size() >= 11 && memcmp(in.end() - 11, "hello world", 11) == 0) {
+                in.clear();
+                ok++;
+                con->send(req);
+            }
+        });
+        con->setStateCallback([&](const TcpConnPtr &con) {
+            if (con->getState() == TcpConn::Connected) {
+                con->send(req);
+            } else if ((con->getState() == TcpConn::Closed || con->getState() == TcpConn::Failed) && !stopping) { // 连接上总有一个在途的请求
+                failed++;
+                loop.runAfter(10, [&] { connect(); });
+            }
+        });
+    };
+    for (int i = 0; i < conns; i++) {
+        connect();
+    }
+    if (crash) {
+        loop.runAfter(secs * 500, [&] {
+            TcpConnPtr con = TcpConn::createConnection(&loop, "127.0.0.1", kPort, 1000);
+            con->setStateCallback([](const TcpConnPtr &con) {
+                if (con->getState() == TcpConn::Connected) {
+                    con->send("GET /crash HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n");
+                }
+            });
+        });
+    }
+    int64_t t0 = util::steadyMicro();
+    loop.runAfter(secs * 1000, [&] {
+        stopping = true;
+        loop.exit();
+    });
+    loop.loop();
+    int64_t used = util::steadyMicro() - t0;
+    kill(server, SIGTERM);
+    int status = 0;
+    waitpid(server, &status, 0);
+    printf("%s %d conns %d%s: %.0f requests/s, failed requests or connects %ld\n", procs ? "procs" : "threads", n, conns, crash ? " crash" : "",
+           ok * 1e6 / used, failed);
+    return 0;
+}
@@ -0,0 +1,148 @@
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <titan/titan.h>
+
+using namespace std;
+using namespace titan;
+
+// 每条消息在IO线程中的开销: 用perf_event_open统计服务端线程的指令数, 周期数(需要硬件计数器)和CPU时间,
+// 并给出一次TcpConnPtr复制加析构的耗时作为参照. 服务端与客户端各自运行在一个线程的EventLoop中
+// 用法: refcount-bench [echo|http] [连接数] [每个连接的消息数]
+
+// 当前线程的性能计数器, 不可用时read返回-1
+struct Counter {
+    int fd;
+    Counter(uint32_t type, uint64_t config) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof attr);
+        attr.type = type;
+        attr.size = sizeof attr;
+        attr.config = config;
+        attr.exclude_kernel = type == PERF_TYPE_HARDWARE; // 软件计数器包括系统调用的时间
+        attr.exclude_hv = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    ~Counter() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    long read() {
+        long v = -1;
+        return fd >= 0 && ::read(fd, &v, sizeof v) == sizeof v ? v : -1;
+    }
+};
+
+struct Counters {
+    Counter instructions, cycles, clock;
+    Counters()
+        : instructions(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS), cycles(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES),
+          clock(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK) {}
+    void snap(long *v) {
+        v[0] = instructions.read();
+        v[1] = cycles.read();
+        v[2] = clock.read();
+    }
+};
+
+static string perMsg(long v0, long v1, long msgs, const char *unit) {
+    return v0 < 0 || v1 < 0 ? string(unit) + " n/a" : util::format("%.0f %s", double(v1 - v0) / msgs, unit);
+}
+
+int main(int argc, const char *argv[]) {
+    string mode = argc > 1 ? argv[1] : "echo";
+    int conns = argc > 2 ? atoi(argv[2]) : 10;
+    int count = argc > 3 ? atoi(argv[3]) : 20000;
+    setloglevel("ERROR");
+
+    // 服务端线程的计数器, 在服务端线程中创建和读取
+    unique_ptr<Counters> svrCounters;
+    long start[3], end[3];
+    EventLoop svrLoop, cliLoop;
+    unique_ptr<HttpServer> httpSvr;
+    TcpServerPtr echoSvr;
+    if (mode == "http") {
+        httpSvr.reset(new HttpServer(&svrLoop));
+        exitif(httpSvr->bind("127.0.0.1", 2499), "bind failed %d(%s)", errno, strerror(errno));
+        httpSvr->setGetCallback("/hello", [](const HttpConnPtr &con) {
+            HttpResponse resp;
+            resp.body = Slice("hello world");
+            con.sendResponse(resp);
+        });
+    } else {
+        echoSvr = TcpServer::startServer(&svrLoop, "127.0.0.1", 2499);
+        exitif(echoSvr == NULL, "start tcp server failed");
+        echoSvr->setTcpConnReadCallback([](const TcpConnPtr &con) { con->send(con->getInput()); });
+    }
+    thread th([&] {
+        svrCounters.reset(new Counters);
+        svrLoop.loop();
+    });
+
+    string req = mode == "http" ? "GET /hello HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n" : string(64, 'x');
+    size_t respSize = mode == "http" ? 0 : req.size();
+    long total = (long) conns * count, received = 0;
+    int connected = 0;
+    int64_t t0 = 0;
+    vector<TcpConnPtr> cons;
+    for (int i = 0; i < conns; i++) {
+        TcpConnPtr con = TcpConn::createConnection(&cliLoop, "127.0.0.1", 2499, 3000);
+        con->setReadCallback([&](const TcpConnPtr &con) {
+            Buffer &in = con->getInput();
+            size_t n = respSize;
+            if (n == 0) { // http响应以"hello world"结尾
+                n = in.size() >= 11 && memcmp(in.end() - 11, "hello world", 11) == 0 ? in.size() : 0;
+            }
+            if (n == 0 || in.size() < n) {
+                return;
+            }
+            in.consume(n);
+            if (++received == total) {
+                cliLoop.exit();
+            } else {
+                con->send(req);
+            }
+        });
+        con->setStateCallback([&](const TcpConnPtr &con) {
+            if (con->getState() == TcpConn::Connected) {
+                if (++connected == conns) { // 所有连接建立之后在服务端线程中读取计数器, 然后开始发送
+                    svrLoop.safeCall([&] {
+                        svrCounters->snap(start);
+                        cliLoop.safeCall([&] {
+                            t0 = util::steadyMicro();
+                            for (auto &c : cons) {
+                                c->send(req);
+                            }
+                        });
+                    });
+                }
+            } else if (con->getState() == TcpConn::Failed) {
+                cliLoop.exit();
+            }
+        });
+        cons.push_back(con);
+    }
+    cliLoop.loop();
+    int64_t used = util::steadyMicro() - t0;
+    svrLoop.safeCall([&] {
+        svrCounters->snap(end);
+        svrLoop.exit();
+    });
+    th.join();
+
+    // 参照: 一次TcpConnPtr复制加析构
+    TcpConnPtr p(new TcpConn);
+    const long copies = 10000000;
+    int64_t c0 = util::steadyMicro();
+    for (long i = 0; i < copies; i++) {
+        TcpConnPtr q(p);
+        __asm__ __volatile__("" : : "r"(q.get()) : "memory");
+    }
+    double copyNs = (util::steadyMicro() - c0) * 1000.0 / copies;
+
+    printf("%s conns %d msgs %ld: %.0f msg/s, server thread per message: %s, %s, %s; TcpConnPtr copy+destroy %.1f ns\n", mode.c_str(), conns,
+           received, received * 1e6 / used, perMsg(start[0], end[0], received, "instructions").c_str(),
+           perMsg(start[1], end[1], received, "cycles").c_str(), perMsg(start[2], end[2], received, "ns cpu").c_str(),
+           copyNs);
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include <sys/wait.h>
+#include <titan/titan.h>
+
+using namespace std;
+using namespace titan;
+
+// 重启期间失败的连接: 客户端持续建立短连接, 每个连接发送一个HTTP请求, 收到响应后关闭. 在一半时间处重启服务端进程:
+// hot: 新进程初始化之后通过HotRestart从旧进程接收监听socket, 旧进程停止accept, 处理完已有连接后退出
+// cold: 旧进程收到SIGTERM退出后, 新进程初始化并重新bind
+// 服务端进程初始化(加载配置, 预热缓存等)用sleep模拟
+// 用法: restart-bench [hot|cold] [并发连接数] [秒数] [新进程初始化毫秒数]
+
+const unsigned short kPort = 2799;
+const char *kPath = "/tmp/titan-restart-bench.sock";
+
+static void runServer(int gen, bool hot, int initMs) {
+    setloglevel("ERROR");
+    EventLoop loop;
+    HttpServer svr(&loop);
+    HotRestart hr(&loop, kPath);
+    vector<vector<int>> fds;
+    if (hot) {
+        fds = hr.takeover(); // 旧进程在新进程初始化期间继续处理请求
+    }
+    usleep(initMs * 1000);
+    int r = fds.empty() ? svr.bind("127.0.0.1", kPort) : svr.adopt(fds[0]);
+    exitif(r, "gen %d listen failed %d(%s)", gen, r, strerror(r));
+    string body = util::format("gen %d", gen);
+    svr.setGetCallback("/hello", [&](const HttpConnPtr &con) {
+        HttpResponse resp;
+        resp.body = body;
+        con.sendResponse(resp);
+    });
+    if (hot) {
+        hr.serve({&svr}, [&] { HotRestart::drain(&loop, 5000, [&] { loop.exit(); }); });
+    }
+    Signal::signal(SIGTERM, [&] { loop.exit(); });
+    loop.loop();
+}
+
+// 服务端进程在客户端创建连接之前fork, 不继承客户端的socket. 向返回的管道写入一个字节后进程开始启动
+static pid_t forkServer(int gen, bool hot, int initMs, int *startFd) {
+    int fds[2];
+    exitif(pipe(fds), "pipe failed");
+    pid_t pid = fork();
+    exitif(pid < 0, "fork failed");
+    if (pid == 0) {
+        close(fds[1]);
+        char c;
+        if (read(fds[0], &c, 1) == 1) {
+            runServer(gen, hot, initMs);
+        }
+        exit(0);
+    }
+    close(fds[0]);
+    *startFd = fds[1];
+    return pid;
+}
+
+static void startServer(int startFd) {
+    exitif(write(startFd, "s", 1) != 1, "start server failed");
+    close(startFd);
+}
+
+int main(int argc, const char *argv[]) {
+    bool hot = argc <= 1 || string(argv[1]) == "hot";
+    int concurrency = argc > 2 ? atoi(argv[2]) : 32;
+    int secs = argc > 3 ? atoi(argv[3]) : 4;
+    int initMs = argc > 4 ? atoi(argv[4]) : 200;
+    setloglevel("ERROR");
+    signal(SIGPIPE, SIG_IGN);
+    unlink(kPath);
+
+    int oldStart, nextStart;
+    pid_t old = forkServer(1, hot, 0, &oldStart);
+    pid_t next = forkServer(2, hot, initMs, &nextStart);
+    startServer(oldStart);
+    usleep(300 * 1000);
+
+    EventLoop loop;
+    string req = "GET /hello HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+    long ok = 0, refused = 0, failed = 0, served[3] = {0, 0, 0};
+    bool stopping = false;
+    Histogram latency;
+    function<void()> request = [&] {
+        if (stopping) {
+            return;
+        }
+        TcpConnPtr con = TcpConn::createConnection(&loop, "127.0.0.1", kPort, 1000);
+        con->context<int64_t>() = util::steadyMicro();
+        con->setReadCallback([&](const TcpConnPtr &con) {
+            Buffer &in = con->getInput();
+            const char *g = (const char *) memmem(in.data(), in.size(), "\r\n\r\ngen ", 8);
+            if (g && g + 9 <= in.end()) {
+                int gen = g[8] - '0';
+                served[gen == 2 ? 2 : 1]++;
+                ok++;
+                latency.add(util::steadyMicro() - con->context<int64_t>());
+                in.clear(); // close时会用剩余的输入再次调用读回调
+                con->setStateCallback(nullptr);
+                con->close();
+                request();
+            }
+        });
+        con->setStateCallback([&](const TcpConnPtr &con) {
+            if (con->getState() == TcpConn::Connected) {
+                con->send(req);
+            } else if (con->getState() == TcpConn::Failed) {
+                refused++; // 连接被拒绝或者超时
+                loop.runAfter(1, [&] { request(); });
+            } else if (con->getState() == TcpConn::Closed) {
+                failed++; // 收到响应之前连接被关闭
+                loop.runAfter(1, [&] { request(); });
+            }
+        });
+    };
+    for (int i = 0; i < concurrency; i++) {
+        request();
+    }
+    loop.runAfter(secs * 500, [&] {
+        if (hot) {
+            startServer(nextStart);
+        } else {
+            thread([&] { // 不阻塞客户端的EventLoop
+                kill(old, SIGTERM);
+                waitpid(old, NULL, 0);
+                startServer(nextStart);
+            }).detach();
+        }
+    });
+    int64_t t0 = util::steadyMicro();
+    loop.runAfter(secs * 1000, [&] {
+        stopping = true;
+        loop.exit();
+    });
+    loop.loop();
+    int64_t used = util::steadyMicro() - t0;
+    if (hot) {
+        waitpid(old, NULL, 0); // 旧进程在交出socket并处理完连接后自己退出
+    }
+    kill(next, SIGTERM);
+    waitpid(next, NULL, 0);
+    unlink(kPath);
+    Histogram::Snapshot h = latency.snapshot();
+    printf("%s restart, concurrency %d init %d ms: %.0f requests/s, served by old %ld new %ld, refused or timed out connects %ld, "
+           "closed before response %ld, latency p99 %ld max %lu us\n",
+           hot ? "hot" : "cold", concurrency, initMs, ok * 1e6 / used, served[1], served[2], refused, failed, (long) h.percentile(0.99),
+           (unsigned long) h.max);
+    return 0;
+}
@@ -0,0 +1,139 @@
+#include <titan/titan.h>
+
+using namespace std;
+using namespace titan;
+
+// 分片计数器: 每个分片保持window个在途请求, 请求把随机key的计数加一, 由key所属的分片执行后回复发起的分片.
+// 对比分片之间用信箱(EventLoop::post)与safeCall传递消息的吞吐和每条消息的内存分配次数
+// 用法: shard-bench [mailbox|safecall] [分片数] [每个分片的在途请求数] [秒数] [key个数]
+
+static atomic<long> allocs(0);
+
+void *operator new(size_t sz) {
+    allocs.fetch_add(1, memory_order_relaxed);
+    void *p = malloc(sz);
+    if (p == NULL) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+// 分片上的计数, 只由所属分片修改
+typedef unordered_map<long, long> Counts;
+
+// 分片作为请求发起方的状态
+struct Driver {
+    uint64_t seed = 0;
+};
+
+// 每个分片收到的回复数, 由主线程读取统计
+struct Replies {
+    atomic<long> n;
+    char pad[64];
+};
+static unique_ptr<Replies[]> replies;
+
+static MultiEventLoops *loops;
+static bool mailbox;
+static long keys;
+
+static void deliver(EventLoop *from, int to, Task &&task) {
+    if (mailbox && from->post(to, std::move(task))) {
+        return;
+    }
+    loops->getLoop(to).safeCall(std::move(task));
+}
+
+static void request(EventLoop *loop) {
+    Driver &d = loop->local<Driver>();
+    d.seed ^= d.seed << 13; // xorshift64
+    d.seed ^= d.seed >> 7;
+    d.seed ^= d.seed << 17;
+    long key = d.seed % keys;
+    int from = loop->shard(), owner = loops->shardOf(key);
+    deliver(loop, owner, [from, owner, key] {
+        EventLoop *o = &loops->getLoop(owner);
+        o->local<Counts>()[key]++;
+        deliver(o, from, [from] {
+            EventLoop *l = &loops->getLoop(from);
+            replies[from].n.fetch_add(1, memory_order_relaxed);
+            request(l);
+        });
+    });
+}
+
+int main(int argc, const char *argv[]) {
+    mailbox = argc <= 1 || string(argv[1]) == "mailbox";
+    int shards = argc > 2 ? atoi(argv[2]) : 4;
+    int window = argc > 3 ? atoi(argv[3]) : 256;
+    int secs = argc > 4 ? atoi(argv[4]) : 3;
+    keys = argc > 5 ? atol(argv[5]) : 100000;
+    setloglevel("ERROR");
+
+    MultiEventLoops ml(shards);
+    loops = &ml;
+    ml.setMailboxes();
+    replies.reset(new Replies[shards]);
+    for (int i = 0; i < shards; i++) {
+        replies[i].n = 0;
+    }
+    for (int i = 0; i < shards; i++) {
+        EventLoop *l = &ml.getLoop(i);
+        l->safeCall([l, window] {
+            for (long k = l->shard(); k < keys; k += l->shards()) { // 预先创建本分片的key, 之后的计数不再分配内存
+                l->local<Counts>()[k] = 0;
+            }
+            l->local<Driver>().seed = util::steadyMicro() * (l->shard() + 1) | 1;
+            for (int j = 0; j < window; j++) {
+                request(l);
+            }
+        });
+    }
+    // 预热一秒之后开始统计
+    long done0 = 0, allocs0 = 0, done1 = 0, allocs1 = 0;
+    int64_t t0 = 0, t1 = 0;
+    auto total = [&] {
+        long n = 0;
+        for (int i = 0; i < shards; i++) {
+            n += replies[i].n.load(memory_order_relaxed);
+        }
+        return n;
+    };
+    EventLoop &l0 = ml.getLoop(0);
+    l0.safeCall([&] {
+        l0.runAfter(1000, [&] {
+            done0 = total();
+            allocs0 = allocs;
+            t0 = util::steadyMicro();
+        });
+        l0.runAfter(1000 + secs * 1000, [&] {
+            done1 = total();
+            allocs1 = allocs;
+            t1 = util::steadyMicro();
+            ml.exit();
+        });
+    });
+    ml.loop();
+
+    long counted = 0;
+    uint64_t full = 0;
+    for (int i = 0; i < shards; i++) {
+        for (auto &kv : ml.getLoop(i).local<Counts>()) {
+            counted += kv.second;
+        }
+        full += ml.getLoop(i).stats().mailboxFull;
+    }
+    long done = done1 - done0;
+    printf("%s shards %d window %d: %.0f requests/s, %.3f allocations per request, mailbox full %lu, counted %ld replied %ld\n",
+           mailbox ? "mailbox" : "safecall", shards, window, done * 1e6 / (t1 - t0), (double) (allocs1 - allocs0) / done, (unsigned long) full,
+           counted, total());
+    return 0;
+}
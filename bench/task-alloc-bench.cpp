@@ -0,0 +1,114 @@
+#include <titan/titan.h>
+
+using namespace std;
+using namespace titan;
+
+// 每条echo消息的内存分配次数: 服务端把消息交给线程池处理, 处理结果通过safeCall回到IO线程发送, 客户端用runAfter设置每条消息的超时.
+// 任务捕获TcpConnPtr, 消息以及其他几个值, 超过std::function的内联容量. 服务端与客户端各自运行在一个线程的EventLoop中
+// 用法: task-alloc-bench [连接数] [每个连接的消息数]
+
+static atomic<long> allocs(0);
+
+void *operator new(size_t sz) {
+    allocs.fetch_add(1, memory_order_relaxed);
+    void *p = malloc(sz);
+    if (p == NULL) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+// 定长消息, 放在栈上, 避免std::string的分配影响统计
+struct Msg {
+    char data[16];
+};
+
+int main(int argc, const char *argv[]) {
+    int conns = argc > 1 ? atoi(argv[1]) : 10;
+    int count = argc > 2 ? atoi(argv[2]) : 20000;
+    setloglevel("ERROR");
+
+    EventLoop svrLoop, cliLoop;
+    ThreadPool pool(1);
+    Histogram turnaround; // 服务端从读到消息到发送回复的时间
+    TcpServerPtr svr = TcpServer::startServer(&svrLoop, "127.0.0.1", 2599);
+    exitif(svr == NULL, "start tcp server failed");
+    svr->setTcpConnReadCallback([&](const TcpConnPtr &con) {
+        Buffer &in = con->getInput();
+        while (in.size() >= sizeof(Msg)) {
+            Msg m;
+            memcpy(&m, in.begin(), sizeof m);
+            in.consume(sizeof m);
+            EventLoop *loop = con->getLoop();
+            int64_t received = loop->nowMicro();
+            pool.addTask([con, m, loop, received, &turnaround] {
+                loop->safeCall([con, m, received, &turnaround] {
+                    turnaround.add(util::steadyMicro() - received);
+                    con->send(m.data, sizeof m.data);
+                });
+            });
+        }
+    });
+    thread th([&] { svrLoop.loop(); });
+
+    // 客户端每个连接同时只有一条消息在途
+    Msg msg;
+    memset(msg.data, 'x', sizeof msg.data);
+    long total = (long) conns * count, received = 0;
+    long allocStart = 0;
+    int64_t t0 = 0;
+    vector<TcpConnPtr> cons;
+    vector<TimerId> timeouts(conns);
+    auto sendMsg = [&](const TcpConnPtr &con, int i) {
+        con->send(msg.data, sizeof msg.data);
+        timeouts[i] = cliLoop.runAfter(3000, [con, i, &cliLoop] {
+            error("connection %d timeout", i);
+            cliLoop.exit();
+        });
+    };
+    for (int i = 0; i < conns; i++) {
+        TcpConnPtr con = TcpConn::createConnection(&cliLoop, "127.0.0.1", 2599, 3000);
+        con->setReadCallback([&, i](const TcpConnPtr &con) {
+            Buffer &in = con->getInput();
+            while (in.size() >= sizeof(Msg)) {
+                in.consume(sizeof(Msg));
+                cliLoop.cancel(timeouts[i]);
+                if (++received == total) {
+                    cliLoop.exit();
+                } else {
+                    sendMsg(con, i);
+                }
+            }
+        });
+        con->setStateCallback([&, i](const TcpConnPtr &con) {
+            if (con->getState() == TcpConn::Connected) {
+                if (t0 == 0) {
+                    allocStart = allocs;
+                    t0 = util::steadyMicro();
+                }
+                sendMsg(con, i);
+            } else if (con->getState() == TcpConn::Failed) {
+                cliLoop.exit();
+            }
+        });
+        cons.push_back(con);
+    }
+    cliLoop.loop();
+    int64_t used = util::steadyMicro() - t0;
+    long allocUsed = allocs - allocStart;
+    svrLoop.exit();
+    th.join();
+    pool.exit().join();
+    Histogram::Snapshot h = turnaround.snapshot();
+    printf("conns %d msgs %ld: %.0f msg/s, %.3f allocations per message (client and server), server turnaround p50 %ld p99 %ld us\n", conns,
+           received, received * 1e6 / used, (double) allocUsed / received, (long) h.percentile(0.5), (long) h.percentile(0.99));
+    return 0;
+}
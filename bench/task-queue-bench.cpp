@@ -0,0 +1,95 @@
+#include <titan/titan.h>
+
+using namespace std;
+using namespace titan;
+
+// 多个生产者线程向同一个消费者投递Task, 对比SafeQueue, MpscQueue以及有界的MpscQueue的吞吐和每个任务的内存分配次数
+
+static atomic<long> allocs(0);
+
+void *operator new(size_t sz) {
+    allocs.fetch_add(1, memory_order_relaxed);
+    void *p = malloc(sz);
+    if (p == NULL) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+template <class Q>
+struct Consumer;
+
+template <>
+struct Consumer<SafeQueue<Task>> {
+    static long consume(SafeQueue<Task> &q) {
+        long c = 0;
+        Task task;
+        while (q.pop_wait(&task, 0)) {
+            task();
+            c++;
+        }
+        return c;
+    }
+};
+
+template <>
+struct Consumer<MpscQueue<Task>> {
+    static long consume(MpscQueue<Task> &q) {
+        return q.drain([](Task &task) { task(); });
+    }
+};
+
+template <class Q>
+double run(Q &q, int producers, long total, double *allocsPerTask) {
+    atomic<long> done(0);
+    long per = total / producers;
+    int64_t t0 = util::steadyMicro();
+    vector<thread> ths;
+    ths.reserve(producers);
+    long a0 = allocs.load();
+    for (int i = 0; i < producers; i++) {
+        ths.emplace_back([&q, &done, per] {
+            for (long j = 0; j < per; j++) {
+                Task task([&done] { done.fetch_add(1, memory_order_relaxed); });
+                while (!q.push(move(task))) { // 有界队列满, 等待消费者
+                    this_thread::yield();
+                }
+            }
+        });
+    }
+    long consumed = 0;
+    while (consumed < per * producers) {
+        consumed += Consumer<Q>::consume(q);
+    }
+    *allocsPerTask = double(allocs.load() - a0 - producers) / consumed; // 不计创建线程的分配
+    for (auto &th : ths) {
+        th.join();
+    }
+    int64_t used = util::steadyMicro() - t0;
+    return consumed * 1.0 / used; // 每微秒处理的任务数
+}
+
+int main(int argc, const char *argv[]) {
+    long total = argc > 1 ? atol(argv[1]) : 1000 * 1000;
+    printf("%-10s %10s %10s %10s %10s %10s %10s\n", "producers", "Safe M/s", "Mpsc M/s", "Bound M/s", "Safe allocs", "Mpsc allocs", "Bound allocs");
+    for (int p = 1; p <= 32; p *= 2) {
+        SafeQueue<Task> sq;
+        MpscQueue<Task> mq, bq(4096); // bq为有界队列, 满了之后生产者等待
+        double sa, ma, ba;
+        run(sq, p, total, &sa); // 第一轮预热, 统计第二轮
+        run(mq, p, total, &ma);
+        run(bq, p, total, &ba);
+        double s = run(sq, p, total, &sa);
+        double m = run(mq, p, total, &ma);
+        double b = run(bq, p, total, &ba);
+        printf("%-10d %10.2f %10.2f %10.2f %11.2f %11.2f %12.2f\n", p, s, m, b, sa, ma, ba);
+    }
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include <titan/titan.h>
+#include <titan/timer_wheel.h>
+#include <map>
+
+using namespace std;
+using namespace titan;
+
+// 原先EventLoop中基于std::map的定时器实现, 用于对比
+struct MapTimers {
+    map<TimerId, Task> timers_;
+    int64_t seq_ = 0;
+    TimerId add(int64_t at, Task &&task) {
+        TimerId tid{at, ++seq_};
+        timers_.insert({tid, std::move(task)});
+        return tid;
+    }
+    bool cancel(TimerId tid) { return timers_.erase(tid) > 0; }
+    void expire(int64_t now) {
+        TimerId tid{now, 1L << 62};
+        while (timers_.size() && timers_.begin()->first < tid) {
+            Task task = std::move(timers_.begin()->second);
+            timers_.erase(timers_.begin());
+            task();
+        }
+    }
+};
+
+struct WheelTimers {
+    TimerWheel wheel_{0};
+    TimerId add(int64_t at, Task &&task) { return TimerId{at, wheel_.add(at, std::move(task))}; }
+    bool cancel(TimerId tid) { return wheel_.cancel(tid.second); }
+    void expire(int64_t now) { wheel_.expire(now); }
+};
+
+template <class T>
+void run(const char *name, int n, const vector<int64_t> &ats) {
+    T timers;
+    vector<TimerId> ids(n);
+    long fired = 0;
+    int64_t t0 = util::steadyMicro();
+    for (int i = 0; i < n; i++) {
+        ids[i] = timers.add(ats[i], [&fired] { fired++; });
+    }
+    int64_t t1 = util::steadyMicro();
+    for (int i = 0; i < n; i++) {
+        timers.cancel(ids[i]);
+    }
+    int64_t t2 = util::steadyMicro();
+    for (int i = 0; i < n; i++) {
+        timers.add(ats[i], [&fired] { fired++; });
+    }
+    int64_t t3 = util::steadyMicro();
+    for (int64_t now = 0; now <= 60 * 1000; now++) { // 模拟事件循环每毫秒处理一次到期的定时器
+        timers.expire(now);
+    }
+    int64_t t4 = util::steadyMicro();
+    printf("%-6s %d timers: insert %6.1f ms  cancel %6.1f ms  fire %6.1f ms (fired %ld)\n", name, n, (t1 - t0) / 1000.0, (t2 - t1) / 1000.0,
+           (t4 - t3) / 1000.0, fired);
+}
+
+int main(int argc, const char *argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 1000 * 1000;
+    vector<int64_t> ats(n);
+    srand(1);
+    for (auto &at : ats) {
+        at = rand() % (60 * 1000); // 60秒内均匀分布的超时
+    }
+    run<MapTimers>("map", n, ats);
+    run<WheelTimers>("wheel", n, ats);
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include <titan/titan.h>
+
+using namespace std;
+using namespace titan;
+
+// 连续执行n次定时任务, 统计实际执行时刻相对预定时刻的延迟
+struct Jitter {
+    EventLoop &loop;
+    bool micro;
+    int64_t delay; // 微秒
+    int left;
+    int64_t expect;
+    vector<int64_t> lags;
+    Jitter(EventLoop &l, bool m, int64_t d, int n) : loop(l), micro(m), delay(d), left(n) {}
+    void schedule() {
+        expect = util::steadyMicro() + delay;
+        if (micro) {
+            loop.runAfterMicro(delay, [this] { onTimer(); });
+        } else {
+            loop.runAfter(delay / 1000, [this] { onTimer(); });
+        }
+    }
+    void onTimer() {
+        lags.push_back(util::steadyMicro() - expect);
+        if (--left > 0) {
+            schedule();
+        } else {
+            loop.exit();
+        }
+    }
+    void report(const char *name) {
+        sort(lags.begin(), lags.end());
+        printf("%-24s n=%zu lag us: min %5ld p50 %5ld p99 %5ld max %5ld\n", name, lags.size(), (long) lags[0], (long) lags[lags.size() / 2],
+               (long) lags[lags.size() * 99 / 100], (long) lags.back());
+    }
+};
+
+void run(const char *name, bool micro, int64_t delay, int n) {
+    EventLoop loop;
+    Jitter j(loop, micro, delay, n);
+    j.schedule();
+    loop.loop();
+    j.report(name);
+}
+
+int main(int argc, const char *argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 2000;
+    run("runAfter(1ms)", false, 1000, n);
+    run("runAfterMicro(1000us)", true, 1000, n);
+    run("runAfterMicro(200us)", true, 200, n);
+    return 0;
+}
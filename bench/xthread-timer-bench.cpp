@@ -0,0 +1,80 @@
+#include <titan/titan.h>
+
+using namespace std;
+using namespace titan;
+
+// 工作线程在IO线程上设置并取消超时: 对比通过safeCall转发与直接调用线程安全的runAfter/cancel.
+// 统计工作线程每次操作的耗时, 每次操作的内存分配次数, 以及IO线程被唤醒的次数
+// 用法: xthread-timer-bench [safecall|direct] [操作次数] [每批操作数]
+
+static atomic<long> allocs(0);
+
+void *operator new(size_t sz) {
+    allocs.fetch_add(1, memory_order_relaxed);
+    void *p = malloc(sz);
+    if (p == NULL) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+int main(int argc, const char *argv[]) {
+    string mode = argc > 1 ? argv[1] : "direct";
+    int n = argc > 2 ? atoi(argv[2]) : 1000000;
+    int batch = argc > 3 ? atoi(argv[3]) : 100;
+    setloglevel("ERROR");
+
+    EventLoop loop;
+    thread th([&] { loop.loop(); });
+    while (!loop.stats().iterations) { // 等待loop()开始
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    vector<shared_ptr<TimerId>> pending(batch);
+    vector<TimerId> ids(batch);
+    long fired = 0;
+    long allocStart = allocs;
+    uint64_t iterStart = loop.stats().iterations;
+    int64_t t0 = util::steadyMicro();
+    // 每批先设置batch个60秒的超时, 再全部取消, 模拟请求完成前的超时保护
+    for (int done = 0; done < n; done += batch) {
+        if (mode == "safecall") {
+            for (int i = 0; i < batch; i++) {
+                shared_ptr<TimerId> id = make_shared<TimerId>();
+                loop.safeCall([&loop, &fired, id] { *id = loop.runAfter(60000, [&fired] { fired++; }); });
+                pending[i] = id;
+            }
+            for (int i = 0; i < batch; i++) {
+                shared_ptr<TimerId> id = pending[i];
+                loop.safeCall([&loop, id] { loop.cancel(*id); });
+            }
+        } else {
+            for (int i = 0; i < batch; i++) {
+                ids[i] = loop.runAfter(60000, [&fired] { fired++; });
+            }
+            for (int i = 0; i < batch; i++) {
+                loop.cancel(ids[i]);
+            }
+        }
+    }
+    int64_t used = util::steadyMicro() - t0;
+    long allocUsed = allocs - allocStart;
+    atomic<bool> drained(false);
+    loop.safeCall([&] { drained = true; });
+    while (!drained) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    uint64_t iterations = loop.stats().iterations - iterStart;
+    loop.exit();
+    th.join();
+    printf("%s ops %d batch %d: %.0f ns per add+cancel on the worker, %.2f allocations per add+cancel, %.4f loop wakeups per add+cancel, fired %ld\n",
+           mode.c_str(), n, batch, used * 1000.0 / n, (double) allocUsed / n, (double) iterations / n, fired);
+    return 0;
+}
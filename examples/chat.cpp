@@ -4,54 +4,101 @@
 using namespace std;
 using namespace titan;
 
+// 每个分片上的用户, 只在所属分片的IO线程中访问. 用户id对分片数取模即为所属分片
+struct Users {
+    map<long, TcpConnPtr> conns;
+    long seq = 0;
+};
+
+// 群发的进度, 只在发起的分片中修改
+struct Broadcast {
+    TcpConnPtr from;
+    int waiting; // 还未回复的分片数
+    int sended;
+};
+
+// 发送到分片shard, 信箱满时改用safeCall
+static void postTo(EventLoop *loop, int shard, Task &&task) {
+    if (!loop->post(shard, std::move(task))) {
+        loop->peer(shard)->safeCall(std::move(task));
+    }
+}
+
 int main(int argc, const char *argv[]) {
+    int threads = argc > 1 ? atoi(argv[1]) : 1;
     setloglevel("TRACE");
-    map<intptr_t, TcpConnPtr> users;  // 生命周期比连接更长，必须放在Loop前
-    EventLoop loop; // 事件派发器
-    Signal::signal(SIGINT, [&] { loop.exit(); }); // 注册信号处理器
-    
-    int userid = 1;
-    TcpServerPtr chat = TcpServer::startServer(&loop, "", 2099); // host == "": INADDR_ANY. bind the socket to all local interfaces 
+    MultiEventLoops loops(threads); // 每个线程一个分片, 用户保存在所属分片的local<Users>()中, 不需要加锁
+    loops.setMailboxes();
+    Signal::signal(SIGINT, [&] { loops.exit(); }); // 注册信号处理器
+
+    TcpServerPtr chat = TcpServer::startServer(&loops, "", 2099); // host == "": INADDR_ANY. bind the socket to all local interfaces
     exitif(chat == NULL, "start tcpserver failed");
+    chat->setCorked(true); // 群发时同一循环中发给一个用户的多条消息合并为一次write
     chat->setTcpConnStateCallback([&](const TcpConnPtr &con) {
+        EventLoop *loop = con->getLoop();
+        Users &users = loop->local<Users>();
         if (con->getState() == TcpConn::Connected) {
-            con->context<int>() = userid;
-            const char *welcome = "<id> <msg>: send msg to <id>\n<msg>: send msg to all\n\nhello %d";
-            con->sendMsg(util::format(welcome, userid));
-            users[userid] = con;
-            userid++;
+            long id = users.seq++ * loop->shards() + loop->shard() + 1;
+            con->context<long>() = id;
+            const char *welcome = "<id> <msg>: send msg to <id>\n<msg>: send msg to all\n\nhello %ld";
+            con->sendMsg(util::format(welcome, id));
+            users.conns[id] = con;
         } else if (con->getState() == TcpConn::Closed) {
-            users.erase(con->context<int>());
+            users.conns.erase(con->context<long>());
         }
     });
     chat->setTcpConnMsgCallback(new LineCodec, [&](const TcpConnPtr &con, Slice msg) {
         if (msg.size() == 0) {  //忽略空消息
             return;
         }
-        int cid = con->context<int>(); // cid是自己的id
+        EventLoop *loop = con->getLoop();
+        int from = loop->shard(), n = loop->shards();
+        long cid = con->context<long>(); // cid是自己的id
         char *p = (char *) msg.data();
-        intptr_t id = strtol(p, &p, 10);
+        long id = strtol(p, &p, 10);
         p += *p == ' ';  //忽略一个空格
         string resp = util::format("%ld# %.*s", cid, msg.end() - p, p);
 
-        int sended = 0;
-        if (id == 0) {  //发给其他所有用户
-            for (auto &pc : users) {
-                if (pc.first != cid) {
+        if (id == 0) {  //发给其他所有用户: 每个分片发给自己的用户, 再把人数发回本分片汇总
+            shared_ptr<Broadcast> b(new Broadcast{con, n, 0});
+            for (int s = 0; s < n; s++) {
+                postTo(loop, s, [&loops, b, s, from, cid, resp] {
+                    int sended = 0;
+                    for (auto &pc : loops.getLoop(s).local<Users>().conns) {
+                        if (pc.first != cid) {
+                            sended++;
+                            pc.second->sendMsg(resp);
+                        }
+                    }
+                    postTo(&loops.getLoop(s), from, [b, sended] {
+                        b->sended += sended;
+                        if (--b->waiting == 0 && b->from->getState() == TcpConn::Connected) {
+                            b->from->sendMsg(util::format("#sended to %d users", b->sended));
+                        }
+                    });
+                });
+            }
+        } else if (id > 0) {  //发给特定用户, 由所属分片发送
+            int s = (id - 1) % n;
+            postTo(loop, s, [&loops, con, s, from, id, resp] {
+                map<long, TcpConnPtr> &conns = loops.getLoop(s).local<Users>().conns;
+                auto p1 = conns.find(id);
+                int sended = 0;
+                if (p1 != conns.end()) {
                     sended++;
-                    pc.second->sendMsg(resp);
+                    p1->second->sendMsg(resp);
                 }
-            }
-        } else {  //发给特定用户
-            auto p1 = users.find(id);
-            if (p1 != users.end()) {
-                sended++;
-                p1->second->sendMsg(resp);
-            }
+                postTo(&loops.getLoop(s), from, [con, sended] {
+                    if (con->getState() == TcpConn::Connected) {
+                        con->sendMsg(util::format("#sended to %d users", sended));
+                    }
+                });
+            });
+        } else {
+            con->sendMsg("#sended to 0 users");
         }
-        con->sendMsg(util::format("#sended to %d users", sended));
     });
-    loop.loop();
+    loops.loop();
     info("program exited");
     return 0;
 }
@@ -3,26 +3,48 @@
 using namespace std;
 using namespace titan;
 
+// 用法: http-hello [线程数] [进程数]. 进程数大于0时由Prefork启动多个worker进程, 每个进程运行指定个数的线程
+void serve(MultiEventLoops &loops, HttpServer &svr) {
+    svr.setGetCallback("/hello", [](const HttpConnPtr &con) {
+        string v = con.getRequest().version;
+        HttpResponse resp;
+        resp.body = Slice("hello world");
+        con.sendResponse(resp);
+        if (v == "HTTP/1.0") {
+            con->closeAfterFlush();
+        }
+    });
+    loops.loop();
+}
+
 int main(int argc, const char *argv[]) {
-    int threads = 1;
+    int threads = 1, processes = 0;
     if (argc > 1) {
         threads = atoi(argv[1]);
     }
+    if (argc > 2) {
+        processes = atoi(argv[2]);
+    }
     setloglevel("TRACE");
+    if (processes > 0) {
+        Prefork pf(processes);
+        exitif(pf.bind("", 8081), "bind failed %d(%s)", errno, strerror(errno));
+        pf.run([threads](int index, const vector<int> &fds) {
+            MultiEventLoops loops(threads);
+            HttpServer svr(&loops);
+            int r = svr.adopt(fds[0], threads > 1 ? TcpServer::Exclusive : TcpServer::Single);
+            exitif(r, "adopt failed %d(%s)", r, strerror(r));
+            Signal::signal(SIGTERM, [&] { loops.exit(); }); // supervisor停止时发送SIGTERM
+            Signal::signal(SIGINT, [&] { loops.exit(); }); // 终端的Ctrl-C同时发给所有进程
+            serve(loops, svr);
+        });
+        return 0;
+    }
     MultiEventLoops loops(threads); // one event loop one thread
     HttpServer svr(&loops);
     int r = svr.bind("", 8081);
     exitif(r, "bind failed %d(%s)", errno, strerror(errno));
-    svr.setGetCallback("/hello", [](const HttpConnPtr &con) {
-        string v = con.getRequest().version;
-        HttpResponse resp;
-        resp.body = Slice("hello world");
-        con.sendResponse(resp);
-        if (v == "HTTP/1.0") {
-            con->close();
-        }
-    });
     Signal::signal(SIGINT, [&] { loops.exit(); });
-    loops.loop();
+    serve(loops, svr);
     return 0;
 }
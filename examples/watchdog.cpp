@@ -0,0 +1,36 @@
+#include <titan/titan.h>
+using namespace titan;
+
+// 回调中阻塞的IO线程由Watchdog记录下来. 链接时加上-rdynamic可以在调用栈中看到函数名
+void slowQuery() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+}
+
+int main(int argc, const char *argv[]) {
+    EventLoop loop;
+    Signal::signal(SIGINT, [&] { loop.exit(); });
+    Watchdog wd(100);
+    wd.watch(&loop).start();
+    TcpServerPtr svr = TcpServer::startServer(&loop, "127.0.0.1", 2099);
+    exitif(svr == NULL, "start tcp server failed");
+    svr->setTcpConnReadCallback([](const TcpConnPtr &con) {
+        slowQuery(); // 阻塞了同一个EventLoop上的所有连接
+        con->send(con->getInput());
+    });
+    TcpConnPtr con = TcpConn::createConnection(&loop, "127.0.0.1", 2099);
+    con->setStateCallback([](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            con->send("hello");
+        }
+    });
+    con->setReadCallback([](const TcpConnPtr &con) {
+        info("echo %.*s", (int) con->getInput().size(), con->getInput().data());
+        con->getInput().clear();
+    });
+    loop.runAfter(100, [] { slowQuery(); });
+    loop.runAfter(1000, [&] {
+        info("%zu stalls detected", wd.stalls());
+        loop.exit();
+    });
+    loop.loop();
+}
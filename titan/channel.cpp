@@ -18,24 +18,15 @@ Channel::~Channel() {
 }
 
 void Channel::enableRead(bool enable) {
-    if (enable) {
-        events_ |= kReadEvent;
-    } else {
-        events_ &= ~kReadEvent;
-    }
-    loop_->poller_->updateChannel(this);
+    enableReadWrite(enable, writeEnabled());
 }
 
 void Channel::enableWrite(bool enable) {
-    if (enable) {
-        events_ |= kWriteEvent;
-    } else {
-        events_ &= ~kWriteEvent;
-    }
-    loop_->poller_->updateChannel(this);
+    enableReadWrite(readEnabled(), enable);
 }
 
 void Channel::enableReadWrite(bool readable, bool writable) {
+    int old = events();
     if (readable) {
         events_ |= kReadEvent;
     } else {
@@ -46,7 +37,10 @@ void Channel::enableReadWrite(bool readable, bool writable) {
     } else {
         events_ &= ~kWriteEvent;
     }
-    loop_->poller_->updateChannel(this);
+    if (events() != old) {
+        statAdd(loop_->stats_.pollUpdates, 1);
+        loop_->poller_->updateChannel(this);
+    }
 }
 
 void Channel::close() { // poller并不拥有channel, channel在析构之前必须自己从poller中unregister(removeChannel), 避免造成空悬指针
@@ -59,6 +53,19 @@ void Channel::close() { // poller并不拥有channel, channel在析构之前必
     }
 }
 
+void Channel::detach() {
+    if (fd_ >= 0) {
+        loop_->poller_->detachChannel(this);
+    }
+}
+
+void Channel::attach(EventLoop *loop) {
+    loop_ = loop;
+    if (fd_ >= 0) {
+        loop_->poller_->addChannel(this);
+    }
+}
+
 bool Channel::readEnabled() {
     return events_ & kReadEvent;
 }
@@ -16,33 +16,49 @@ struct Channel : private noncopyable {
     int fd() { return fd_; }
     //通道id
     int64_t id() { return id_; }
-    short events() { return events_; }
+    // 注册到poller的事件. 边沿触发时始终包含可写事件
+    int events() { return events_ & EPOLLET ? events_ | kWriteEvent : events_; }
     //关闭通道
     void close();
+    // 从当前EventLoop中移除, fd保持打开. 需要在当前EventLoop的线程中调用
+    void detach();
+    // 加入loop, 关注的事件不变. 需要在loop的线程中调用
+    void attach(EventLoop *loop);
 
     //挂接事件处理器
-    void setReadCallback(const Task &readcb) { readcb_ = readcb; }
-    void setWriteCallback(const Task &writecb) { writecb_ = writecb; }
     void setReadCallback(Task &&readcb) { readcb_ = std::move(readcb); }
     void setWriteCallback(Task &&writecb) { writecb_ = std::move(writecb); }
 
-    //启用读写监听
+    /* 启用读写监听, 关注的事件没有变化时不修改poller.
+       边沿触发(events包含EPOLLET)时可写事件始终注册在poller中, enableWrite只修改writeEnabled()的返回值, 不需要系统调用.
+       此时可写事件只在writeEnabled()时分发, 并且只在可写状态变化时产生, 应当在写到EAGAIN之后才enableWrite(true);
+       读回调需要读到EAGAIN
+    */
     void enableRead(bool enable);
     void enableWrite(bool enable);
     void enableReadWrite(bool readable, bool writable);
     bool readEnabled();
     bool writeEnabled();
+    bool edgeTriggered() { return events_ & EPOLLET; }
+
+    /* 完成模式(PollerBase::completionIO)下poller交回的结果, 此时没有读写事件. IoRecv: res为收到的字节数, 0为对端关闭,
+       负数为-errno, data只在回调中有效; IoSend: res为发送的字节数或-errno; IoAccept: res为新连接的fd或-errno
+    */
+    typedef std::function<void(IoOp op, int res, const char *data)> CompletionCallback;
+    void setCompletionCallback(CompletionCallback &&cb) { completecb_ = std::move(cb); }
 
     //处理读写事件
     void handleRead() { readcb_(); }
     void handleWrite() { writecb_(); }
+    void handleCompletion(IoOp op, int res, const char *data) { completecb_(op, res, data); }
 
    protected:
     EventLoop *loop_;
     int fd_;
-    short events_;
+    int events_;
     int64_t id_;
-    std::function<void()> readcb_, writecb_;
+    Task readcb_, writecb_;
+    CompletionCallback completecb_;
 };
 
 }  // namespace titan
\ No newline at end of file
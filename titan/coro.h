@@ -0,0 +1,219 @@
+#pragma once
+/* 基于C++20协程的连接处理, 只有头文件, 使用时需要以-std=c++20编译. 库本身仍然以C++11编译.
+   协程由连接的Channel读写回调和EventLoop的定时器恢复, 始终在连接所属的EventLoop中执行.
+   每个连接一个协程帧, 读写和等待过程中不再创建std::function
+
+    co::serve(svr, [](TcpConnPtr con) -> co::CoTask {
+        LengthCodec codec;
+        Slice msg;
+        while (co_await co::readMsg(con, codec, msg)) {
+            codec.encode(msg, con->getOutput());
+            con->sendOutput();
+            co_await co::drain(con);
+        }
+    });
+
+   连接关闭时, 正在等待的读写操作返回false, 协程应当随之结束. 协程状态保存在TcpConn::internalCtx_中, 不能与HttpServer一起使用
+*/
+#if __cplusplus >= 202002L
+
+#include <coroutine>
+#include <exception>
+#include "tcp_conn.h"
+#include "tcp_server.h"
+
+namespace titan {
+namespace co {
+
+// 不需要等待结果的协程, 创建后立即执行, 结束时释放协程帧
+struct CoTask {
+    struct promise_type {
+        CoTask get_return_object() { return CoTask(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// 连接上等待读写的协程. ready不为NULL时, 只有ready(arg)返回true才恢复等待读的协程
+struct ConnState {
+    std::coroutine_handle<> reader, writer;
+    bool (*ready)(void *arg);
+    void *arg;
+    size_t consumed; // 上一次readMsg返回的消息长度, 下一次读取时从input_中移除
+    ConnState() : ready(NULL), arg(NULL), consumed(0) {}
+};
+
+inline ConnState &state(TcpConn *con) {
+    return con->internalCtx_.context<ConnState>();
+}
+
+inline void wake(std::coroutine_handle<> &h) {
+    if (h) {
+        std::coroutine_handle<> t = h;
+        h = nullptr;
+        t.resume();
+    }
+}
+
+inline void onRead(const TcpConnPtr &con) {
+    ConnState &st = state(con.get());
+    if (st.reader && (st.ready == NULL || st.ready(st.arg))) {
+        wake(st.reader);
+    }
+}
+
+inline void onWritable(const TcpConnPtr &con) {
+    wake(state(con.get()).writer);
+}
+
+inline void onState(const TcpConnPtr &con, const std::function<CoTask(TcpConnPtr)> &handler) {
+    if (con->getState() == TcpConn::Connected) {
+        handler(con);
+    } else if (con->getState() == TcpConn::Closed || con->getState() == TcpConn::Failed) {
+        ConnState &st = state(con.get());
+        wake(st.reader);
+        wake(st.writer);
+    }
+}
+
+// 客户端连接: createConnection之后, 在连接所属的EventLoop中调用, handler在连接建立时启动
+inline void start(const TcpConnPtr &con, const std::function<CoTask(TcpConnPtr)> &handler) {
+    con->setReadCallback(onRead);
+    con->setWriteCallback(onWritable);
+    con->setStateCallback([handler](const TcpConnPtr &con) { onState(con, handler); });
+}
+
+// 服务器上每个新连接启动一个handler协程
+inline void serve(const TcpServerPtr &svr, const std::function<CoTask(TcpConnPtr)> &handler) {
+    svr->setTcpConnReadCallback(onRead);
+    svr->setTcpConnStateCallback([handler](const TcpConnPtr &con) {
+        if (con->getState() == TcpConn::Connected) {
+            con->setWriteCallback(onWritable);
+        }
+        onState(con, handler);
+    });
+}
+
+inline bool alive(TcpConn *con) {
+    return con->getState() == TcpConn::Connected;
+}
+
+inline bool alive(const TcpConnPtr &con) {
+    return alive(con.get());
+}
+
+// 移除上一次readMsg返回的消息
+inline void consumeLast(TcpConn *con) {
+    ConnState &st = state(con);
+    con->getInput().consume(st.consumed);
+    st.consumed = 0;
+}
+
+/* 以下awaiter保存在协程帧中, 只借用连接的指针, co_await时不复制TcpConnPtr. 协程的参数TcpConnPtr保证了连接在
+   协程结束之前有效
+*/
+// 等待input_中有数据, 返回时数据留在input_中由调用者消费. 连接关闭返回false
+struct ReadAwaiter {
+    TcpConn *con;
+    bool await_ready() {
+        consumeLast(con);
+        return con->getInput().size() || !alive(con);
+    }
+    void await_suspend(std::coroutine_handle<> h) { state(con).reader = h; }
+    bool await_resume() { return con->getInput().size() > 0; }
+};
+
+// 读取一个完整的消息, msg在下一次读取之前有效. 连接关闭或者解码出错返回false
+struct MsgAwaiter {
+    TcpConn *con;
+    CodecBase &codec;
+    Slice &msg;
+    int r;
+    static bool decode(void *arg) {
+        MsgAwaiter *m = (MsgAwaiter *) arg;
+        m->r = m->codec.tryDecode(m->con->getInput(), m->msg);
+        if (m->r < 0) {
+            m->con->close();
+        }
+        return m->r != 0;
+    }
+    bool await_ready() {
+        consumeLast(con);
+        return decode(this) || !alive(con);
+    }
+    void await_suspend(std::coroutine_handle<> h) {
+        ConnState &st = state(con);
+        st.reader = h;
+        st.ready = decode;
+        st.arg = this; // 协程挂起期间awaiter保存在协程帧中
+    }
+    bool await_resume() {
+        ConnState &st = state(con);
+        st.ready = NULL;
+        if (r <= 0) {
+            return false;
+        }
+        st.consumed = r;
+        return true;
+    }
+};
+
+// 等待output_中的数据全部写入内核(完成模式下包括正在进行的发送), 连接关闭返回false
+struct DrainAwaiter {
+    TcpConn *con;
+    bool await_ready() { return con->flushed() || !alive(con); }
+    void await_suspend(std::coroutine_handle<> h) { state(con).writer = h; }
+    bool await_resume() { return con->flushed(); }
+};
+
+// 持有挂起的协程, 没有恢复就被析构时(比如EventLoop退出时清除了定时器)释放协程帧
+struct FrameGuard {
+    std::coroutine_handle<> h;
+    explicit FrameGuard(std::coroutine_handle<> handle) : h(handle) {}
+    FrameGuard(FrameGuard &&o) noexcept : h(o.h) { o.h = nullptr; }
+    FrameGuard(const FrameGuard &) = delete;
+    ~FrameGuard() {
+        if (h) {
+            h.destroy();
+        }
+    }
+    void resume() {
+        std::coroutine_handle<> t = h;
+        h = nullptr;
+        t.resume();
+    }
+};
+
+// 等待ms毫秒, 由EventLoop的定时器恢复. 定时器没有执行时协程帧随定时器一起释放
+struct SleepAwaiter {
+    EventLoop *loop;
+    int64_t ms;
+    bool await_ready() { return ms <= 0; }
+    void await_suspend(std::coroutine_handle<> h) {
+        loop->runAfter(ms, [g = FrameGuard(h)]() mutable { g.resume(); });
+    }
+    void await_resume() {}
+};
+
+inline ReadAwaiter read(const TcpConnPtr &con) {
+    return ReadAwaiter{con.get()};
+}
+
+inline MsgAwaiter readMsg(const TcpConnPtr &con, CodecBase &codec, Slice &msg) {
+    return MsgAwaiter{con.get(), codec, msg, 0};
+}
+
+inline DrainAwaiter drain(const TcpConnPtr &con) {
+    return DrainAwaiter{con.get()};
+}
+
+inline SleepAwaiter sleep(EventLoop *loop, int64_t ms) {
+    return SleepAwaiter{loop, ms};
+}
+
+}  // namespace co
+}  // namespace titan
+
+#endif
@@ -1,6 +1,11 @@
 #include "event_loop.h"
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <map>
 #include "tcp_conn.h"
 #include "logging.h"
@@ -12,24 +17,23 @@ using namespace std;
 
 namespace titan {
 
+std::atomic<size_t> EventLoop::localSeq_(0);
+
 EventLoop::EventLoop(int taskCap)
-        : poller_(new EpollPoller()), exit_(false), nextTimeout_(1 << 30), tasks_(taskCap), timerSeq_(0), idleEnabled(false) {
-    int r = pipe2(wakeupFds_, O_CLOEXEC);
-    fatalif(r, "pipe2 failed %d(%s)", errno, strerror(errno));
-    trace("wakeup pipe created %d %d", wakeupFds_[0], wakeupFds_[1]);
-    Channel *ch = new Channel(this, wakeupFds_[0], kReadEvent);
+        : poller_(new EpollPoller()), exit_(false), wakeupPending_(false), tid_(std::thread::id()), nextTimeout_(1 << 30), nowMicro_(util::steadyMicro()), iterEnd_(nowMicro_), busyPollMax_(0), spinBudget_(0), lastActive_(0), spinning_(false), cpu_(-1), node_(-1), conns_(0), pendingConns_(0), bytesRate_(0), lag_(0), loadAt_(nowMicro_), loadBytes_(0), maxBusy_(0), tasks_(taskCap), timers_(nowMicro_ / 1000), hrTimers_(NULL), hrChannel_(NULL), timerSeq_(0), sweepAt_(64), hrArmed_(-1), idleEnabled(false), running_(RunNone), runningFd_(-1), runningId_(0), busySince_(0), thread_(pthread_t()), capturing_(0), shard_(-1) {
+    wakeupFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fatalif(wakeupFd_ < 0, "eventfd failed %d(%s)", errno, strerror(errno));
+    trace("wakeup eventfd created %d", wakeupFd_);
+    Channel *ch = new Channel(this, wakeupFd_, kReadEvent);
     ch->setReadCallback([=] {
-        char buf[1024];
-        int r = ch->fd() >= 0 ? ::read(ch->fd(), buf, sizeof buf) : 0;
+        uint64_t cnt;
+        int r = ch->fd() >= 0 ? ::read(ch->fd(), &cnt, sizeof cnt) : 0;
         if (r > 0) {
-            Task task;
-            while (tasks_.pop_wait(&task, 0)) {
-                task();
-            }
+            wakeupPending_ = false; // 先清除标志再执行任务, 之后添加的任务会再次唤醒. 任务由loop_once末尾的runTasks执行
         } else if (r == 0) { // Channel::close() => handleRead()
             trace("delete wakeup channel");
             delete ch;
-        } else if (errno == EINTR) {
+        } else if (errno == EINTR || errno == EAGAIN) {
         } else {
             fatal("wakeup channel read error %d %d %s", r, errno, strerror(errno));
         }
@@ -37,25 +41,186 @@ EventLoop::EventLoop(int taskCap)
 }
 
 EventLoop::~EventLoop() {
-    delete poller_;  
-    ::close(wakeupFds_[1]);
+    tid_ = std::this_thread::get_id(); // 关闭连接时取消定时器等操作直接执行, 不再放入队列唤醒已关闭的eventfd
+    outbox_.clear(); // 其他分片可能已经析构, 之后的post返回false
+    peers_.clear();
+    for (auto q : inbox_) { // 丢弃退出前最后一次循环之后收到的消息
+        q->drain([](Task &) {});
+    }
+    delete poller_; // eventfd, timerfd由各自的channel关闭
+    releaseRetired();
+    locals_.clear();
+    delete hrTimers_;
 }
 
 void EventLoop::loop() {
+    thread_ = pthread_self();
+    tid_ = std::this_thread::get_id();
+    bindCpus();
+    iterEnd_ = util::steadyMicro();
     while (!exit_) {
         loop_once(10000); // 最长等待时间是10s
     }
+    foreignTimers_.clear();
     timers_.clear();
+    if (hrTimers_) {
+        hrTimers_->clear();
+    }
     idleConns_.clear();
+    deferredReads_.clear();
     for (auto recon : reconnectConns_) {  //重连的连接无法通过channel清理，因此单独清理
         recon->cleanup(recon);
     }
     loop_once(0);
+    busySince_.store(0, std::memory_order_relaxed); // 已退出的循环不是卡顿
+    thread_ = pthread_t();
+    while (capturing_.load() > 0) { // loop()返回后线程可能被join, 等待已发出的信号处理完
+        std::this_thread::yield();
+    }
 }
 
 void EventLoop::loop_once(int waitMs) {
-    poller_->loop_once(std::min(waitMs, nextTimeout_));
+    int wait = tasks_.empty() && timerOps_.empty() && deferredReads_.empty() && !mailboxPending() ? std::min(waitMs, nextTimeout_) : 0; // 上次循环的任务又添加了任务时不能阻塞
+    if (busyPollMax_ && wait > 0) {
+        wait = busyPollWait(wait);
+    }
+    busySince_.store(0, std::memory_order_relaxed);
+    int n = poller_->poll(wait);
+    updateNow(); // 回调中使用的时钟每次循环只读取一次
+    busySince_.store(nowMicro_, std::memory_order_relaxed);
+    if (!timerOps_.empty()) {
+        runTimerOps();
+    }
+    if (busyPollMax_ && (n > 0 || !tasks_.empty())) {
+        if (spinning_ && spinBudget_ < busyPollMax_) { // 轮询期间等到了事件, 加大轮询时长
+            spinBudget_ = std::min(spinBudget_ * 2, busyPollMax_);
+        }
+        lastActive_ = nowMicro_;
+    }
+    poller_->dispatch();
+    if (!deferredReads_.empty()) {
+        runDeferredReads();
+    }
     handleTimeouts();
+    runTasks();
+    if (!inbox_.empty()) {
+        runMailboxes();
+    }
+    if (!corked_.empty()) {
+        flushCorked();
+    }
+    if (!retired_.empty()) {
+        releaseRetired();
+    }
+    if (!notify_.empty()) {
+        notifyPeers();
+    }
+    int64_t end = util::steadyMicro();
+    statAdd(stats_.iterations, 1);
+    stats_.pollWait.add(nowMicro_ - iterEnd_);
+    stats_.events.add(n > 0 ? n : 0);
+    stats_.busy.add(end - nowMicro_);
+    iterEnd_ = end;
+    maxBusy_ = std::max(maxBusy_, end - nowMicro_);
+    if (end - loadAt_ >= 1000000) {
+        updateLoad(end);
+    }
+}
+
+bool EventLoop::setPoller(PollerType type) {
+    if (type == poller_->type()) {
+        return true;
+    }
+    PollerBase *p = createPoller(type);
+    std::vector<Channel *> chs = poller_->channels();
+    for (Channel *ch : chs) { // eventfd, timerfd等已创建的channel
+        poller_->detachChannel(ch);
+        p->addChannel(ch);
+    }
+    delete poller_;
+    poller_ = p;
+    return p->type() == type;
+}
+
+void EventLoop::updateLoad(int64_t now) {
+    uint64_t bytes = stats_.bytesRead.load(std::memory_order_relaxed) + stats_.bytesWritten.load(std::memory_order_relaxed);
+    bytesRate_ = (bytes - loadBytes_) * 1000000 / (now - loadAt_);
+    lag_ = maxBusy_;
+    loadAt_ = now;
+    loadBytes_ = bytes;
+    maxBusy_ = 0;
+}
+
+static std::string cpuList(const std::vector<int> &cpus) {
+    std::string r;
+    for (size_t i = 0; i < cpus.size(); i++) {
+        r += util::format(i ? ",%d" : "%d", cpus[i]);
+    }
+    return r;
+}
+
+void EventLoop::bindCpus() {
+    if (cpus_.size()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int c : cpus_) {
+            CPU_SET(c, &set);
+        }
+        int r = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+        if (r) {
+            error("bind loop thread to cpus %s failed %d(%s)", cpuList(cpus_).c_str(), r, strerror(r));
+        }
+    }
+    unsigned cpu = -1, node = -1;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+        cpu_ = cpu;
+        node_ = node;
+    }
+    if (cpus_.size()) {
+        info("loop thread bound to cpus %s, running on cpu %d node %d", cpuList(cpus_).c_str(), (int) cpu_, (int) node_);
+    }
+}
+
+int EventLoop::busyPollWait(int wait) {
+    if (nowMicro_ - lastActive_ < spinBudget_) {
+        if (!spinning_) {
+            spinning_ = true;
+            wakeupPending_ = true; // 生产者看到已有未处理的唤醒, 不再写eventfd
+        }
+        return 0;
+    }
+    if (spinning_) { // 轮询超时, 减小轮询时长, 恢复eventfd唤醒后再阻塞
+        spinning_ = false;
+        spinBudget_ = std::max(spinBudget_ / 2, std::max(busyPollMax_ / 16, int64_t(1)));
+        wakeupPending_ = false;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!tasks_.empty() || !timerOps_.empty() || mailboxPending()) { // 清除标志之前加入的任务不会再唤醒
+            return 0;
+        }
+    }
+    return wait;
+}
+
+IdleList::~IdleList() {
+    for (int i = 0; i <= idle_; i++) {
+        IdleLink &b = buckets_[i];
+        while (b.next_ != &b) {
+            IdleIdImp *node = (IdleIdImp *) b.next_;
+            node->unlink();
+            node->lst_ = NULL;
+            node->cb_ = nullptr;
+            TcpConnPtr con;
+            con.swap(node->con_); // node由连接持有, 可能随con一起释放
+        }
+    }
+}
+
+void IdleList::link(IdleIdImp *node) {
+    IdleLink &b = buckets_[node->updated_ % (idle_ + 1)];
+    node->prev_ = b.prev_;
+    node->next_ = &b;
+    b.prev_->next_ = node;
+    b.prev_ = node;
 }
 
 IdleId EventLoop::registerIdle(int idle, const TcpConnPtr &con, const TcpCallback &cb) { // 注册一个空闲连接
@@ -63,114 +228,461 @@ IdleId EventLoop::registerIdle(int idle, const TcpConnPtr &con, const TcpCallbac
         runAfter(1000, [this] { callIdles(); }, 1000); // 注册一个定时器, 该定时器任务每秒都要执行一次callIdles().
         idleEnabled = true;
     }
-    auto &lst = idleConns_[idle];
-    lst.push_back(IdleNode{con, util::timeMilli() / 1000, std::move(cb)});
+    std::unique_ptr<IdleList> &lst = idleConns_[idle];
+    if (!lst) {
+        lst.reset(new IdleList(idle, now() / 1000));
+    }
+    IdleId id(new IdleIdImp);
+    id->con_ = con;
+    id->updated_ = now() / 1000;
+    id->cb_ = cb;
+    id->lst_ = lst.get();
+    lst->link(id.get());
     trace("register idle");
-    return IdleId(new IdleIdImp(&lst, --lst.end())); // 使用IdleNode所在链表和指向它的迭代器来表示它.
+    return id;
 }
 
 void EventLoop::unregisterIdle(const IdleId &id) { // 删除一个空闲连接
     trace("unregister idle");
-    id->lst_->erase(id->iter_);
+    if (id->lst_) {
+        id->unlink();
+        id->lst_ = NULL;
+        id->cb_ = nullptr;
+        id->con_.reset();
+    }
 }
 
-void EventLoop::updateIdle(const IdleId &id) {
-    trace("update idle");
-    id->iter_->updated_ = util::timeMilli() / 1000;
-    id->lst_->splice(id->lst_->end(), *id->lst_, id->iter_);
+void EventLoop::updateIdle(const IdleId &id) { // 只记录时间, 由callIdles检查到期的桶时再移动
+    id->updated_ = now() / 1000;
 }
 
-void EventLoop::callIdles() { // idleConns_按照idle由小到大排序, idle相同的连接链表按照updated从小到大排序
-    int64_t now = util::timeMilli() / 1000;
+void EventLoop::callIdles() {
+    int64_t sec = now() / 1000;
     for (auto &l : idleConns_) {
-        int idle = l.first;
-        auto lst = l.second;
-        while (lst.size()) {
-            IdleNode &node = lst.front();
-            if (node.updated_ + idle > now) {
-                break;
+        IdleList *lst = l.second.get();
+        int64_t end = sec - lst->idle_; // 该时刻及之前放入的连接可能已经空闲超时
+        for (int64_t s = std::max(lst->swept_ + 1, end - lst->idle_); s <= end; s++) {
+            IdleLink head; // 先摘下整个桶, 回调中注销或者新加入的连接不影响遍历
+            IdleLink &b = lst->buckets_[s % (lst->idle_ + 1)];
+            if (b.next_ == &b) {
+                continue;
+            }
+            head.next_ = b.next_;
+            head.prev_ = b.prev_;
+            head.next_->prev_ = head.prev_->next_ = &head;
+            b.next_ = b.prev_ = &b;
+            while (head.next_ != &head) {
+                IdleIdImp *node = (IdleIdImp *) head.next_;
+                node->unlink();
+                if (node->updated_ + lst->idle_ > sec) { // 期间有活动, 放入updated_对应的桶
+                    lst->link(node);
+                    continue;
+                }
+                node->updated_ = sec;
+                lst->link(node);
+                TcpConnPtr con = node->con_; // 回调中可能注销node
+                TcpCallback cb = node->cb_;
+                cb(con);
             }
-            node.updated_ = now;
-            lst.splice(lst.end(), lst, lst.begin());
-            node.cb_(node.con_);
         }
+        lst->swept_ = std::max(lst->swept_, end);
     }
 }
 
-TimerId EventLoop::runAt(int64_t milli, Task &&task, int64_t interval) { // 添加定时任务: 一次性任务和重复任务
+// 添加定时任务: 一次性任务和重复任务. 以本次循环的时间戳为基准, 回调执行过久时定时器会相应提前
+TimerId EventLoop::runAfter(int64_t milli, Task &&task, int64_t interval) {
     if (exit_) {
         return TimerId();
     }
+    if (!isInLoopThread()) {
+        return queueTimer(util::steadyMilli() + milli, std::move(task), interval, 0);
+    }
+    int64_t at = now() + milli;
+    int64_t handle = timers_.add(at, std::move(task), interval);
+    updateNextTimeOut();
+    return TimerId{interval ? -at : at, handle}; // 使用+- at, 来区分是否为重复任务
+}
 
-    if (interval) { // interval=0表示一次性任务，否则为重复任务
-        TimerId tid{-milli, ++timerSeq_};
-        TimerRepeatable &rtr = timerReps_[tid]; // std::map T& operator[]( const Key& key );
-        rtr = {milli, interval, {milli, ++timerSeq_}, std::move(task)};
-        TimerRepeatable *tr = &rtr;
-        timers_[tr->timerid] = [this, tr] { onRepeatableTimer(tr); };
-        updateNextTimeOut();
-        return tid;
-    } else {
-        TimerId tid{milli, ++timerSeq_}; // 使用+- milli, 来区分是否为重复任务
-        timers_.insert({tid, std::move(task)});
-        updateNextTimeOut();
-        return tid;
+TimerId EventLoop::runAfterMicro(int64_t micro, Task &&task, int64_t interval) {
+    if (exit_) {
+        return TimerId();
+    }
+    int64_t at = util::steadyMicro() + micro;
+    if (!isInLoopThread()) {
+        return queueTimer(at, std::move(task), interval, kHighResTimerTag);
+    }
+    return TimerId{interval ? -at : at, addHighRes(at, std::move(task), interval)};
+}
+
+int64_t EventLoop::addHighRes(int64_t at, Task &&task, int64_t interval) {
+    if (hrTimers_ == NULL) {
+        int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC); // 与util::steadyMicro使用同一个时钟
+        fatalif(fd < 0, "timerfd_create failed %d(%s)", errno, strerror(errno));
+        trace("high resolution timerfd created %d", fd);
+        hrTimers_ = new TimerWheel(util::steadyMicro(), kHighResTimerTag);
+        hrChannel_ = new Channel(this, fd, kReadEvent);
+        Channel *ch = hrChannel_;
+        ch->setReadCallback([=] {
+            uint64_t cnt;
+            int r = ch->fd() >= 0 ? ::read(ch->fd(), &cnt, sizeof cnt) : 0;
+            if (r > 0) {
+                hrArmed_ = -1;
+                setRunning(RunHighResTimer);
+                hrTimers_->expire(util::steadyMicro(), &stats_.timerLag); // 不使用本次循环缓存的时间, 以免提前判断为未到期
+                armHighResTimer();
+            } else if (r == 0) { // Channel::close() => handleRead()
+                trace("delete timerfd channel");
+                hrChannel_ = NULL;
+                delete ch;
+            } else if (errno == EINTR || errno == EAGAIN) {
+            } else {
+                fatal("timerfd channel read error %d %d %s", r, errno, strerror(errno));
+            }
+        });
+    }
+    int64_t handle = hrTimers_->add(at, std::move(task), interval);
+    armHighResTimer();
+    return handle;
+}
+
+void EventLoop::armHighResTimer() {
+    if (hrChannel_ == NULL) {
+        return;
+    }
+    int64_t next = hrTimers_->nextExpire();
+    if (next == hrArmed_ || (next < 0 && hrArmed_ < 0)) {
+        return;
+    }
+    struct itimerspec its;
+    memset(&its, 0, sizeof its);
+    if (next >= 0) { // it_value全为0表示停止timerfd, 因此到期时刻至少为1微秒
+        next = std::max(next, int64_t(1));
+        its.it_value.tv_sec = next / 1000000;
+        its.it_value.tv_nsec = next % 1000000 * 1000;
     }
+    int r = timerfd_settime(hrChannel_->fd(), TFD_TIMER_ABSTIME, &its, NULL);
+    fatalif(r, "timerfd_settime failed %d(%s)", errno, strerror(errno));
+    hrArmed_ = next;
+}
+
+TimerId EventLoop::queueTimer(int64_t at, Task &&task, int64_t interval, int64_t tag) {
+    int64_t id = kForeignTimerTag | tag | timerSeq_++;
+    timerOps_.push(TimerOp{id, at, interval, std::move(task)});
+    wakeup(); // 已有未处理的唤醒时不写eventfd, 一批操作只唤醒一次
+    return TimerId{interval ? -at : at, id};
 }
 
 bool EventLoop::cancel(TimerId timerid) {
-    if (timerid.first < 0) { // 重复任务
-        auto p = timerReps_.find(timerid); 
-        if (p == timerReps_.end()) return false;
-        auto ptimer = timers_.find(p->second.timerid);
-        if (ptimer != timers_.end()) {
-            timers_.erase(ptimer);
-        }
-        timerReps_.erase(p);
+    if (timerid.second == 0) {
+        return false;
+    }
+    if (!isInLoopThread()) {
+        timerOps_.push(TimerOp{timerid.second, 0, 0, Task()});
+        wakeup();
         return true;
-    } else { // milli>0, 一次性任务
-        auto p = timers_.find(timerid);
-        if (p != timers_.end()) {
-            timers_.erase(p);
-            return true;
+    }
+    return cancelInLoop(timerid.second, true);
+}
+
+bool EventLoop::cancelInLoop(int64_t id, bool drain) {
+    if (id & kForeignTimerTag) {
+        auto it = foreignTimers_.find(id);
+        if (it == foreignTimers_.end()) {
+            if (!drain || timerOps_.empty()) {
+                return false;
+            }
+            runTimerOps(); // 添加操作可能还在队列中
+            it = foreignTimers_.find(id);
+            if (it == foreignTimers_.end()) {
+                return false;
+            }
         }
-        return false;
+        id = it->second;
+        foreignTimers_.erase(it);
     }
+    if (id & kHighResTimerTag) {
+        return hrTimers_ && hrTimers_->cancel(id); // 取消后timerfd可能提前触发一次, 不需要重新设置
+    }
+    return timers_.cancel(id);
 }
 
-void EventLoop::handleTimeouts() {
-    int64_t now = util::timeMilli();
-    TimerId tid{now, 1L << 62};
-    while (timers_.size() && timers_.begin()->first < tid) {
-        Task task = std::move(timers_.begin()->second);
-        timers_.erase(timers_.begin()); // std::map.erase O(log(n))
-        task();
+void EventLoop::runTimerOps() {
+    timerOps_.drain([this](TimerOp &op) {
+        if (!op.task) {
+            cancelInLoop(op.id, false);
+        } else if (!exit_) {
+            int64_t handle = op.id & kHighResTimerTag ? addHighRes(op.at, std::move(op.task), op.interval) : timers_.add(op.at, std::move(op.task), op.interval);
+            foreignTimers_[op.id] = handle;
+        }
+    });
+    updateNextTimeOut();
+    if (foreignTimers_.size() >= sweepAt_) { // 已执行的一次性定时器没有从foreignTimers_中删除, 表的大小每翻一倍清除一次
+        for (auto it = foreignTimers_.begin(); it != foreignTimers_.end();) {
+            bool pending = it->second & kHighResTimerTag ? hrTimers_->pending(it->second) : timers_.pending(it->second);
+            it = pending ? std::next(it) : foreignTimers_.erase(it);
+        }
+        sweepAt_ = std::max(foreignTimers_.size() * 2, size_t(64));
     }
+}
+
+void EventLoop::handleTimeouts() {
+    setRunning(RunTimer);
+    timers_.expire(now(), &stats_.timerLag, 1000); // 毫秒定时器的延迟只精确到毫秒
     updateNextTimeOut();
 }
 
 void EventLoop::updateNextTimeOut() { // 更新距离当前时刻最近的定时器的超时时间间隔
-    if (timers_.empty()) {
+    int64_t next = timers_.nextExpire();
+    if (next < 0) {
         nextTimeout_ = 1 << 30; // 大概是20多天时间
     } else {
-        const TimerId &t = timers_.begin()->first;
-        nextTimeout_ = t.first - util::timeMilli();
-        nextTimeout_ = nextTimeout_ < 0 ? 0 : nextTimeout_;
+        int64_t wait = next - now();
+        nextTimeout_ = wait < 0 ? 0 : std::min(wait, int64_t(1) << 30);
     }
 }
 
-// 重复性定时器到期时执行的task.
-void EventLoop::onRepeatableTimer(TimerRepeatable *tr) {
-    tr->at += tr->interval;
-    tr->timerid = {tr->at, ++timerSeq_};
-    timers_[tr->timerid] = [this, tr] { onRepeatableTimer(tr); }; // map.insert(重复任务下一次发生时的Task)
-    updateNextTimeOut();
-    tr->cb(); // 执行重复任务
+void EventLoop::safeCall(Task &&task) { // 跨线程添加计算任务. void addTask(Task &&task)
+    tasks_.push(QueuedTask{std::move(task), util::steadyMicro()});
+    if (!isInLoopThread()) {
+        wakeup(); // IO线程唤醒之后, 就会执行tasks_中的任务
+    }
 }
 
-void EventLoop::safeCall(Task &&task) { // 跨线程添加计算任务. void addTask(Task &&task)
-    tasks_.push(std::move(task));
-    wakeup(); // IO线程唤醒之后, 就会执行tasks_中的任务
+void EventLoop::runTasks() {
+    if (tasks_.empty()) {
+        return;
+    }
+    int64_t start = util::steadyMicro();
+    size_t n = tasks_.drain([&](QueuedTask &t) {
+        stats_.taskWait.add(start - t.queued);
+        setRunning(RunTask, t.queued);
+        t.task();
+    });
+    stats_.taskBatch.add(n);
+}
+
+void EventLoop::runDeferredReads() {
+    std::vector<TcpConnPtr> cons;
+    cons.swap(deferredReads_); // 本次仍未读完的连接重新加入deferredReads_, 在下次循环处理
+    for (auto &con : cons) {
+        con->readDeferred_ = false;
+        if (con->getLoop() != this) { // 已迁移, 在新的EventLoop中继续
+            con->getLoop()->safeCall([con] { con->deferRead(con); });
+        } else if (con->channel_ && con->getState() == TcpConn::Connected) {
+            setRunning(RunRead, con->channel_->id(), con->channel_->fd());
+            con->handleRead(con);
+        }
+    }
+}
+
+void EventLoop::flushCorked() {
+    for (size_t i = 0; i < corked_.size(); i++) { // writablecb_中的send可能加入新的连接, 关闭的连接会从corked_中移除
+        TcpConnPtr con = corked_[i];
+        if (con->getLoop() == this && con->flushQueued_) { // 迁移的连接在迁移之前已经发送
+            con->flush(true);
+        }
+    }
+    corked_.clear();
+}
+
+bool EventLoop::post(int shard, Task &&task) {
+    if (shard < 0 || shard >= (int) outbox_.size()) { // 未设置信箱, 正在析构或者shardOf返回了-1
+        return false;
+    }
+    if (!outbox_[shard]->push(std::move(task))) {
+        statAdd(stats_.mailboxFull, 1);
+        return false;
+    }
+    if (shard != shard_ && !notifyMark_[shard]) {
+        notifyMark_[shard] = 1;
+        notify_.push_back(shard);
+    }
+    return true;
+}
+
+bool EventLoop::mailboxPending() {
+    for (auto q : inbox_) {
+        if (!q->empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void EventLoop::runMailboxes() {
+    size_t n = 0;
+    for (size_t i = 0; i < inbox_.size(); i++) {
+        if (inbox_[i]->empty()) {
+            continue;
+        }
+        setRunning(RunMailbox, i);
+        n += inbox_[i]->drain([](Task &t) { t(); }); // 执行中post到本分片的消息在下次循环执行
+    }
+    statAdd(stats_.mailboxMsgs, n);
+}
+
+void EventLoop::notifyPeers() {
+    for (int s : notify_) {
+        notifyMark_[s] = 0;
+        peers_[s]->wakeup(); // 对方正在处理或者忙轮询时不写eventfd
+    }
+    notify_.clear();
+}
+
+void EventLoop::releaseRetired() {
+    std::vector<TcpConnPtr> cons;
+    cons.swap(retired_);
+    for (auto &con : cons) {
+        if (con->channel_ == NULL) { // 没有重连
+            con->self_.reset();
+        }
+    }
+}
+
+MultiEventLoops &MultiEventLoops::setAffinity(const std::vector<std::vector<int>> &cpuSets) {
+    for (size_t i = 0; i < loops_.size() && cpuSets.size(); i++) {
+        loops_[i].setAffinity(cpuSets[i % cpuSets.size()]);
+    }
+    return *this;
+}
+
+MultiEventLoops &MultiEventLoops::pinToCpus(std::vector<int> cpus) {
+    if (cpus.empty()) {
+        cpu_set_t set;
+        int r = pthread_getaffinity_np(pthread_self(), sizeof set, &set);
+        fatalif(r, "pthread_getaffinity_np failed %d(%s)", r, strerror(r));
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &set)) {
+                cpus.push_back(c);
+            }
+        }
+    }
+    std::vector<std::vector<int>> sets;
+    for (int c : cpus) {
+        sets.push_back(std::vector<int>{c});
+    }
+    return setAffinity(sets);
+}
+
+double MultiEventLoops::defaultLoad(EventLoop *loop) {
+    return loop->connections() + loop->bytesRate() / 65536.0 + loop->lag() / 100.0;
+}
+
+EventLoop *MultiEventLoops::candidate(int i, EventLoop *exclude) {
+    if (exclude && i >= exclude - &loops_[0]) {
+        i++;
+    }
+    return &loops_[i];
+}
+
+int MultiEventLoops::candidates(EventLoop *exclude) {
+    return loops_.size() - (exclude ? 1 : 0);
+}
+
+MultiEventLoops::Selector MultiEventLoops::roundRobin() {
+    return [](MultiEventLoops *ml, EventLoop *exclude) {
+        int c = ml->id_++;
+        return ml->candidate(c % ml->candidates(exclude), exclude);
+    };
+}
+
+MultiEventLoops::Selector MultiEventLoops::leastConns() {
+    return [](MultiEventLoops *ml, EventLoop *exclude) {
+        int n = ml->candidates(exclude);
+        int start = ml->id_++; // 连接数相同时轮流选择
+        EventLoop *best = NULL;
+        for (int i = 0; i < n; i++) {
+            EventLoop *l = ml->candidate((start + i) % n, exclude);
+            if (best == NULL || l->connections() < best->connections()) {
+                best = l;
+            }
+        }
+        return best;
+    };
+}
+
+MultiEventLoops::Selector MultiEventLoops::powerOfTwo(const std::function<double(EventLoop *)> &load) {
+    return [load](MultiEventLoops *ml, EventLoop *exclude) {
+        static thread_local uint64_t seed = util::steadyMicro() | 1;
+        seed ^= seed << 13; // xorshift64
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        int n = ml->candidates(exclude);
+        if (n == 1) {
+            return ml->candidate(0, exclude);
+        }
+        int a = seed % n;
+        int b = (a + 1 + (seed >> 32) % (n - 1)) % n; // 与a不同
+        EventLoop *la = ml->candidate(a, exclude), *lb = ml->candidate(b, exclude);
+        return load(la) <= load(lb) ? la : lb;
+    };
+}
+
+MultiEventLoops &MultiEventLoops::setSelector(const Selector &selector, bool excludeAcceptor) {
+    selector_ = selector;
+    excludeAcceptor_ = excludeAcceptor;
+    return *this;
+}
+
+EventLoop *MultiEventLoops::allocConnLoop(EventLoop *acceptor) {
+    if (acceptor < &loops_[0] || acceptor > &loops_.back() || !excludeAcceptor_ || loops_.size() == 1) {
+        acceptor = NULL; // 不属于本对象的EventLoop不需要排除
+    }
+    return selector_(this, acceptor);
+}
+
+MultiEventLoops &MultiEventLoops::setRebalance(int64_t intervalMs, int64_t minLagUs, double ratio) {
+    loops_[0].runAfter(intervalMs, [=] { rebalance(minLagUs, ratio); }, intervalMs);
+    return *this;
+}
+
+void MultiEventLoops::rebalance(int64_t minLagUs, double ratio) {
+    EventLoop *hot = NULL, *cold = NULL;
+    for (auto &l : loops_) {
+        if (hot == NULL || l.lag() > hot->lag()) {
+            hot = &l;
+        }
+        if (cold == NULL || l.lag() < cold->lag()) {
+            cold = &l;
+        }
+    }
+    if (hot == cold || hot->lag() < minLagUs || hot->lag() < cold->lag() * ratio) {
+        return;
+    }
+    hot->safeCall([hot, cold] { // 连接列表只能在所属的IO线程访问
+        TcpConn *best = NULL;
+        for (TcpConn *c : hot->liveConns_) {
+            if (c->getState() == TcpConn::Connected && (best == NULL || c->bytes_ > best->bytes_)) {
+                best = c;
+            }
+            c->bytes_ = 0;
+        }
+        if (best && hot->liveConns_.size() > 1) {
+            info("rebalance: loop lag %ldus vs %ldus, moving %s", (long) hot->lag(), (long) cold->lag(), best->peerAddrStr().c_str());
+            best->migrate(cold);
+        }
+    });
+}
+
+MultiEventLoops &MultiEventLoops::setMailboxes(size_t capacity) {
+    size_t n = loops_.size();
+    mailboxes_.clear();
+    for (size_t i = 0; i < n * n; i++) {
+        mailboxes_.emplace_back(new SpscQueue<Task>(capacity));
+    }
+    for (size_t i = 0; i < n; i++) {
+        EventLoop &l = loops_[i];
+        l.peers_.clear();
+        l.inbox_.clear();
+        l.outbox_.clear();
+        for (size_t j = 0; j < n; j++) {
+            l.peers_.push_back(&loops_[j]);
+            l.outbox_.push_back(mailboxes_[i * n + j].get());
+            l.inbox_.push_back(mailboxes_[j * n + i].get());
+        }
+        l.notifyMark_.assign(n, 0);
+    }
+    return *this;
 }
 
 void MultiEventLoops::loop() {
@@ -1,7 +1,10 @@
 #pragma once
 #include <list>
+#include <unordered_map>
 #include "titan-imp.h"
 #include "poller.h"
+#include "timer_wheel.h"
+#include "stats.h"
 
 namespace titan {
 
@@ -10,29 +13,61 @@ typedef std::shared_ptr<TcpServer> TcpServerPtr;
 typedef std::function<void(const TcpConnPtr &)> TcpCallback;
 typedef std::function<void(const TcpConnPtr &, Slice msg)> MsgCallback;
 
-struct IdleNode {
+struct IdleLink {
+    IdleLink() : prev_(this), next_(this) {}
+    void unlink() {
+        prev_->next_ = next_;
+        next_->prev_ = prev_;
+        prev_ = next_ = this;
+    }
+    IdleLink *prev_, *next_;
+};
+
+struct IdleList;
+
+// 空闲连接的注册信息, 由TcpConn通过IdleId持有
+struct IdleIdImp : public IdleLink {
     TcpConnPtr con_;
-    int64_t updated_;
+    int64_t updated_; // 最后活跃的时刻(秒)
     TcpCallback cb_;
+    IdleList *lst_; // NULL表示已注销
 };
 
-struct IdleIdImp {
-    IdleIdImp() {}
-    typedef std::list<IdleNode>::iterator Iter;
-    IdleIdImp(std::list<IdleNode> *lst, Iter iter) : lst_(lst), iter_(iter) {}
-    std::list<IdleNode> *lst_;
-    Iter iter_;
+// 相同idle时长的连接, 按放入的时刻(秒)分到idle+1个桶中. 连接活跃时只更新updated_,
+// 每秒只检查已到期的桶, 其中期间有活动的连接按updated_放入新的桶, 开销与空闲连接总数无关
+struct IdleList {
+    IdleList(int idle, int64_t now) : idle_(idle), swept_(now - idle), buckets_(new IdleLink[idle + 1]) {}
+    ~IdleList();
+    void link(IdleIdImp *node);
+    int idle_;
+    int64_t swept_; // 该时刻及之前的桶已经检查过
+    std::unique_ptr<IdleLink[]> buckets_;
 };
 
-struct TimerRepeatable {
-    int64_t at;  // current timer timeout timestamp
+// tasks_中的任务, queued为加入队列的时刻(微秒), 用于统计等待时间
+struct QueuedTask {
+    Task task;
+    int64_t queued;
+};
+
+const int64_t kHighResTimerTag = int64_t(1) << 62;
+const int64_t kForeignTimerTag = INT64_MIN; // 其他线程添加的定时器, 低位为序号, 在IO线程中映射到时间轮的句柄
+
+// 其他线程对定时器的操作, 在IO线程中批量执行. task为空表示取消id
+struct TimerOp {
+    int64_t id;
+    int64_t at; // 按util::steadyMilli()或者util::steadyMicro()(高精度定时器)计算的到期时刻
     int64_t interval;
-    TimerId timerid; // 此timerId就是timers_中的key
-    Task cb;
+    Task task;
 };
 
 struct EventLoopBases : private noncopyable {
     virtual EventLoop *allocEventLoop() = 0;
+    // 为acceptor上接受的新连接分配EventLoop, 默认与allocEventLoop相同
+    virtual EventLoop *allocConnLoop(EventLoop * /*acceptor*/) { return allocEventLoop(); }
+    // 包含的EventLoop个数以及其中第i个, 用于在每个EventLoop上监听
+    virtual int loopCount() { return 1; }
+    virtual EventLoop *loopAt(int /*i*/) { return allocEventLoop(); }
 };
 
 //事件派发器，可管理定时器，连接，超时连接
@@ -49,55 +84,290 @@ struct EventLoop : public EventLoopBases {
     void updateIdle(const IdleId &id);
     void callIdles();
 
-    // 添加定时任务，interval=0表示一次性任务，否则为重复任务，时间为毫秒
-    TimerId runAt(int64_t milli, Task &&task, int64_t interval = 0);
-    TimerId runAt(int64_t milli, const Task &task, int64_t interval = 0) { return runAt(milli, Task(task), interval); }
-    TimerId runAfter(int64_t milli, const Task &task, int64_t interval = 0) { return runAt(util::timeMilli() + milli, Task(task), interval); }
-    TimerId runAfter(int64_t milli, Task &&task, int64_t interval = 0) { return runAt(util::timeMilli() + milli, std::move(task), interval); }
-    // 取消定时任务
+    // 事件循环的单调时钟, 每次从poll返回时更新一次, 回调中读取不需要系统调用. 与墙上时间无关, 不受NTP调整影响
+    int64_t now() { return nowMicro_ / 1000; }
+    int64_t nowMicro() { return nowMicro_; }
+    void updateNow() { nowMicro_ = util::steadyMicro(); }
+
+    /* 添加定时任务，interval=0表示一次性任务，否则为重复任务，时间为毫秒. runAt的时刻为墙上时间(util::timeMilli)
+       返回的TimerId.first为按now()计算的到期时刻(重复任务取负值).
+       定时器的添加和取消可在任意线程调用: 其他线程的操作放入timerOps_队列, 立即返回TimerId, IO线程在下次循环中批量执行,
+       连续多次操作只唤醒一次. 其他线程调用cancel时无法得知结果, 只要timerid有效就返回true
+    */
+    TimerId runAt(int64_t milli, Task &&task, int64_t interval = 0) { return runAfter(milli - util::timeMilli(), std::move(task), interval); }
+    TimerId runAfter(int64_t milli, Task &&task, int64_t interval = 0);
+    // 高精度定时任务, 时间为微秒, 由timerfd触发, 第一次调用时创建timerfd. runAtMicro的时刻为墙上时间(util::timeMicro)
+    // 返回的TimerId.first为按util::steadyMicro()计算的到期时刻
+    TimerId runAtMicro(int64_t micro, Task &&task, int64_t interval = 0) { return runAfterMicro(micro - util::timeMicro(), std::move(task), interval); }
+    TimerId runAfterMicro(int64_t micro, Task &&task, int64_t interval = 0);
+    // 取消定时任务, 包括高精度定时任务
     bool cancel(TimerId timerid);
     void handleTimeouts(); // 处理超时定时器
     void updateNextTimeOut();
-    void onRepeatableTimer(TimerRepeatable *tr);
+    void armHighResTimer(); // 按最早的高精度定时器设置timerfd
+    int64_t addHighRes(int64_t at, Task &&task, int64_t interval); // 在IO线程中添加高精度定时器, 返回句柄
+    TimerId queueTimer(int64_t at, Task &&task, int64_t interval, int64_t tag); // 其他线程添加定时器
+    bool cancelInLoop(int64_t id, bool drain); // drain为true时找不到其他线程添加的定时器, 先执行队列中的操作
+    void runTimerOps(); // 执行其他线程对定时器的操作
 
     // 下列函数为线程安全的
     void exit() {
         exit_ = true;
-        wakeup(); // 如果是IO线程调用exit()需要唤醒吗
+        wakeup(); // 信号处理函数中调用时也需要唤醒
     }
     bool exited() { return exit_; }
-    //添加任务
+    //添加任务. IO线程自己添加的任务在本次循环末尾执行, 不需要唤醒
     void safeCall(Task &&task);
-    void safeCall(const Task &task) { safeCall(Task(task)); }
+    // 已有未处理的唤醒时不再写eventfd, 连续多次唤醒只产生一次系统调用
     void wakeup() {
-        int r = write(wakeupFds_[1], "", 1);
-        fatalif(r <= 0, "write error wd %d %d(%s)", r, errno, strerror(errno));
+        if (!wakeupPending_.exchange(true)) {
+            uint64_t one = 1;
+            int r = write(wakeupFd_, &one, sizeof one);
+            fatalif(r != sizeof one, "write error wd %d %d(%s)", r, errno, strerror(errno));
+        }
+    }
+    bool isInLoopThread() { return tid_ == std::this_thread::get_id(); }
+    //一次取走tasks_中的所有任务并执行
+    void runTasks();
+    // 继续读取上次循环中用完读预算的连接, 见TcpConn::setReadBudget
+    void runDeferredReads();
+    // 释放本次循环中关闭的连接对TcpConn::self_的持有
+    void releaseRetired();
+    // 发送本次循环中合并的数据, 见TcpConn::setCorked
+    void flushCorked();
+    /* 分片: MultiEventLoops中的每个EventLoop是一个分片, shard()为其下标, 独立的EventLoop为-1.
+       分片之间不共享数据, 每个分片的数据放在local<T>()中, 只在本分片的IO线程访问; 需要其他分片的数据时用post发送消息到所属分片
+    */
+    int shard() { return shard_; }
+    // 分片总数, 未调用MultiEventLoops::setMailboxes时为0
+    int shards() { return peers_.size(); }
+    EventLoop *peer(int shard) { return peers_[shard]; }
+    // key所属的分片, 与MultiEventLoops::shardOf相同. 未设置信箱(shards()为0)时返回-1
+    template <class K>
+    int shardOf(const K &key) {
+        return peers_.empty() ? -1 : int(std::hash<K>()(key) % peers_.size());
     }
+    // 本EventLoop的类型为T的对象, 第一次访问时默认构造, EventLoop析构时释放. 只能在IO线程中访问
+    template <class T>
+    T &local();
+    /* 把task放入到分片shard的信箱, 由该分片的IO线程在循环末尾按顺序执行. 只能在IO线程中调用.
+       同一次循环中发往同一分片的消息只唤醒一次, 唤醒在本次循环的末尾进行. 信箱已满时返回false, task保持不变,
+       调用者可以稍后重试, 或者改用peer(shard)->safeCall. shard不在[0, shards())中时也返回false
+    */
+    bool post(int shard, Task &&task);
+    // 执行其他分片发来的消息
+    void runMailboxes();
+    bool mailboxPending();
+    // 唤醒本次循环中post过的分片
+    void notifyPeers();
+    // 当前循环的序号, 用于按循环计算读预算
+    uint64_t iteration() { return stats_.iterations.load(std::memory_order_relaxed); }
+    // 忙轮询时计算本次epoll_wait的超时时间
+    int busyPollWait(int wait);
+    // 在loop()线程中按cpus_绑定CPU, 记录所在的CPU和NUMA节点
+    void bindCpus();
+    // 每秒更新一次bytesRate_和lag_
+    void updateLoad(int64_t now);
     //分配一个事件派发器
     virtual EventLoop *allocEventLoop() { return this; }
+    virtual EventLoop *loopAt(int /*i*/) { return this; }
+    /* 忙轮询: 有事件或任务之后的budgetUs微秒内以0超时调用epoll_wait, 之后再阻塞等待. 0表示关闭.
+       实际的轮询时长在budgetUs/16到budgetUs之间自适应: 轮询期间等到事件则加倍, 轮询超时则减半.
+       轮询期间其他线程的safeCall不写eventfd. 需要在loop()之前调用
+    */
+    void setBusyPoll(int64_t budgetUs) {
+        busyPollMax_ = budgetUs;
+        spinBudget_ = budgetUs;
+    }
+    int64_t busyPollBudget() { return spinBudget_; }
+    /* 更换IO多路复用的实现, 已有的channel转移到新的poller中. 需要在loop()之前调用.
+       Uring见UringPoller, 内核为6.0以上时TcpConn和TcpServer使用基于完成的IO, 不支持io_uring时使用epoll并返回false
+    */
+    bool setPoller(PollerType type);
+    PollerType pollerType() { return poller_->type(); }
+    // 运行loop()的线程绑定到cpus中的CPU上, 在loop()开始时生效, 空表示不绑定. 需要在loop()之前调用
+    // 连接和缓冲区在IO线程中分配, 绑定后按first-touch策略使用该CPU所在NUMA节点的内存
+    void setAffinity(const std::vector<int> &cpus) { cpus_ = cpus; }
+    const std::vector<int> &affinity() { return cpus_; }
+    // loop()开始时线程所在的CPU和NUMA节点, 之前为-1. 可在任意线程调用
+    int cpu() { return cpu_; }
+    int node() { return node_; }
+    // 运行统计的快照, 可在任意线程调用
+    LoopStats::Snapshot stats() {
+        LoopStats::Snapshot s = stats_.snapshot();
+        s.queued = tasks_.size();
+        s.connections = connections();
+        return s;
+    }
+    // 负载信息, 用于选择EventLoop, 可在任意线程调用
+    // 连接数, 包括已分配但还未加入本EventLoop的连接
+    int connections() { return conns_ + pendingConns_; }
+    // 上一秒连接读写的字节数
+    int64_t bytesRate() { return bytesRate_; }
+    // 上一秒中单次循环执行回调的最长时间(微秒), 即新事件最多需要等待的时间
+    int64_t lag() { return lag_; }
+    // 正在执行的回调, 由IO线程记录, 供Watchdog在其他线程读取. id: channel为channel id, 任务为加入队列的时刻
+    enum Running {
+        RunNone = 0,
+        RunRead,
+        RunWrite,
+        RunTimer,
+        RunHighResTimer,
+        RunTask,
+        RunMailbox,
+    };
+    void setRunning(Running what, int64_t id = 0, int fd = -1) {
+        running_.store(what, std::memory_order_relaxed);
+        runningId_.store(id, std::memory_order_relaxed);
+        runningFd_.store(fd, std::memory_order_relaxed);
+    }
+    // 本次循环开始执行回调的时刻(微秒), 在poll中等待时为0
+    int64_t busySince() { return busySince_.load(std::memory_order_relaxed); }
 
-    EpollPoller *poller_;
+    PollerBase *poller_;
     std::atomic<bool> exit_; // exit_是是否退出事件处理循环loop()的标志
-    int wakeupFds_[2];
+    int wakeupFd_; // eventfd
+    std::atomic<bool> wakeupPending_; // 已写入eventfd但IO线程还未处理
+    std::atomic<std::thread::id> tid_; // 运行loop()的线程
     int nextTimeout_; // 即将生效的定时器发生时间与当前时间的差值
-    SafeQueue<Task> tasks_; // task中的任务是在IO线程被wakeup()后, 执行的回调函数readcb_中执行的.
-    std::map<TimerId, Task> timers_; // 定时器队列: 定时器包含一次性和重复性定时器
-    std::map<TimerId, TimerRepeatable> timerReps_; // 重复任务队列
-    std::atomic<int64_t> timerSeq_; // 定时器序号
-    // 记录每个idle时间（单位秒）下所有的连接. 链表中的所有连接，最新的插入到链表末尾. 连接若有活动，会把连接从链表中移到链表尾部，做法参考memcache
-    std::map<int, std::list<IdleNode>> idleConns_;
+    int64_t nowMicro_; // 本次循环的时间戳, 单位微秒
+    int64_t iterEnd_; // 上次循环结束的时刻, 单位微秒
+    int64_t busyPollMax_; // 忙轮询时长的上限, 0表示不轮询
+    int64_t spinBudget_; // 当前的忙轮询时长
+    int64_t lastActive_; // 最后一次有IO事件或任务的时刻
+    bool spinning_; // 正在忙轮询, 此时wakeupPending_保持为true
+    std::vector<int> cpus_; // 绑定的CPU
+    std::atomic<int> cpu_, node_;
+    std::atomic<int> conns_; // 由TcpConn维护
+    std::set<TcpConn *> liveConns_; // 本EventLoop上的连接, 由TcpConn维护, 用于选择迁移的连接
+    std::atomic<int> pendingConns_; // 已经分配, 但还在tasks_中等待加入的连接
+    std::atomic<int64_t> bytesRate_, lag_;
+    int64_t loadAt_; // 上次计算bytesRate_和lag_的时刻
+    uint64_t loadBytes_; // 上次计算时读写的总字节数
+    int64_t maxBusy_; // 本秒内执行回调的最长时间
+    MpscQueue<QueuedTask> tasks_; // task中的任务在每次循环的末尾执行, 其他线程添加任务后通过wakeup()唤醒IO线程
+    TimerWheel timers_; // 定时器: 包含一次性和重复性定时器, TimerId.second为时间轮中的句柄
+    TimerWheel *hrTimers_; // 高精度定时器, 以微秒为tick, 句柄带有kHighResTimerTag
+    Channel *hrChannel_; // timerfd
+    std::atomic<int64_t> timerSeq_; // 其他线程添加的定时器的序号
+    MpscQueue<TimerOp> timerOps_;
+    std::unordered_map<int64_t, int64_t> foreignTimers_; // 其他线程添加的定时器id到时间轮句柄, 已执行的一次性定时器定期清除
+    size_t sweepAt_; // foreignTimers_达到该大小时清除已执行的定时器
+    int64_t hrArmed_; // timerfd当前设置的到期时刻, -1表示未设置
+    // 记录每个idle时间（单位秒）下所有的连接
+    std::map<int, std::unique_ptr<IdleList>> idleConns_;
     std::set<TcpConnPtr> reconnectConns_;
+    std::vector<TcpConnPtr> retired_; // 本次循环中关闭的连接
+    std::vector<TcpConnPtr> corked_; // output_中有待发送数据的合并发送连接, 在本次循环的末尾发送
+    std::vector<TcpConnPtr> deferredReads_; // 用完读预算的连接, 在下次循环的IO事件之后继续读取, 不为空时poll不阻塞
     bool idleEnabled;
+    LoopStats stats_; // 只在IO线程中更新
+    std::atomic<int> running_, runningFd_;
+    std::atomic<int64_t> runningId_, busySince_;
+    std::atomic<pthread_t> thread_; // 运行loop()的线程, 用于Watchdog获取调用栈, loop()返回前清空
+    std::atomic<int> capturing_; // Watchdog正在向thread_发送信号的次数, loop()返回前等待其归零
+    int shard_;
+    std::vector<EventLoop *> peers_; // 所有分片, 下标为分片号
+    std::vector<SpscQueue<Task> *> inbox_, outbox_; // inbox_[i]为分片i发给本分片的消息, outbox_[i]为发给分片i的消息, 由MultiEventLoops持有
+    std::vector<int> notify_; // 本次循环中post过的分片
+    std::vector<char> notifyMark_; // 分片是否已在notify_中
+    std::vector<std::shared_ptr<void>> locals_; // local<T>()的对象, 下标为localIndex
+    static std::atomic<size_t> localSeq_; // 已分配的local类型个数
 };
 
+template <class T>
+T &EventLoop::local() {
+    static const size_t localIndex = localSeq_++; // 每个类型一个下标, 所有EventLoop相同
+    if (localIndex >= locals_.size()) {
+        locals_.resize(localIndex + 1);
+    }
+    std::shared_ptr<void> &p = locals_[localIndex];
+    if (!p) {
+        p = std::make_shared<T>();
+    }
+    return *static_cast<T *>(p.get());
+}
+
 //多线程的事件派发器
 struct MultiEventLoops : public EventLoopBases {
-    MultiEventLoops(int sz) : id_(0), loops_(sz), threads_(sz-1) {} 
+    // 选择EventLoop的策略, exclude不为NULL时不能选择exclude
+    typedef std::function<EventLoop *(MultiEventLoops *loops, EventLoop *exclude)> Selector;
+    MultiEventLoops(int sz) : id_(0), loops_(sz), threads_(sz-1), selector_(roundRobin()), excludeAcceptor_(false) {
+        for (int i = 0; i < sz; i++) {
+            loops_[i].shard_ = i;
+        }
+    }
     virtual EventLoop *allocEventLoop() { // 使用round-robin算法分配EventLoop
         int c = id_++;
         return &loops_[c % loops_.size()];
     }
+    // 按setSelector设置的策略为新连接分配EventLoop
+    virtual EventLoop *allocConnLoop(EventLoop *acceptor);
+    virtual int loopCount() { return loops_.size(); }
+    virtual EventLoop *loopAt(int i) { return &loops_[i]; }
+    // 设置新连接的分配策略, 默认为roundRobin. excludeAcceptor为true时不把连接分配给运行TcpServer的EventLoop. 需要在loop()之前调用
+    MultiEventLoops &setSelector(const Selector &selector, bool excludeAcceptor = false);
+    // 内置的策略: 轮流分配
+    static Selector roundRobin();
+    // 选择连接数最少的EventLoop
+    static Selector leastConns();
+    // 随机选择两个EventLoop, 取load较小的一个
+    static Selector powerOfTwo(const std::function<double(EventLoop *)> &load = defaultLoad);
+    // 默认的负载: 每64KB/s的流量或者100微秒的lag相当于一个连接
+    static double defaultLoad(EventLoop *loop);
+    // exclude之外的EventLoop个数, 以及其中第i个
+    int candidates(EventLoop *exclude);
+    EventLoop *candidate(int i, EventLoop *exclude);
     void loop();
+    int size() { return loops_.size(); }
+    // 第i个EventLoop的线程绑定到cpuSets[i % cpuSets.size()], 见EventLoop::setAffinity. 最后一个EventLoop运行在调用loop()的线程上
+    MultiEventLoops &setAffinity(const std::vector<std::vector<int>> &cpuSets);
+    // 每个EventLoop的线程绑定一个CPU: 第i个绑定到cpus[i % cpus.size()], cpus为空时依次使用当前线程可用的CPU
+    MultiEventLoops &pinToCpus(std::vector<int> cpus = std::vector<int>());
+    /* 自动迁移连接: 每intervalMs毫秒比较各EventLoop的lag(), 当最大的lag超过minLagUs, 并且是最小的ratio倍以上时,
+       把lag最大的EventLoop上近期流量最大的连接迁移到lag最小的EventLoop, 每次最多迁移一个. lag每秒更新一次,
+       intervalMs应当不小于1000. 需要在loop()之前调用. 默认不开启: 连接在用户不知情的情况下迁移, 用户在原EventLoop上
+       为连接设置的定时器和EventLoop::local()中的状态不会随连接迁移, 只有不依赖这些状态的服务才能开启
+    */
+    MultiEventLoops &setRebalance(int64_t intervalMs, int64_t minLagUs = 1000, double ratio = 2);
+    void rebalance(int64_t minLagUs, double ratio);
+    // 所有EventLoop开启忙轮询, 见EventLoop::setBusyPoll
+    MultiEventLoops &setBusyPoll(int64_t budgetUs) {
+        for (auto &b : loops_) {
+            b.setBusyPoll(budgetUs);
+        }
+        return *this;
+    }
+    // 所有EventLoop更换poller, 见EventLoop::setPoller. 有一个不支持时返回false
+    bool setPoller(PollerType type) {
+        bool ok = true;
+        for (auto &b : loops_) {
+            ok = b.setPoller(type) && ok;
+        }
+        return ok;
+    }
+    EventLoop &getLoop(int i) { return loops_[i]; }
+    /* 在每两个EventLoop之间建立容量为capacity的单生产者单消费者信箱, 之后可以用EventLoop::post在分片之间发送消息.
+       共size()*size()个信箱, 每个占用capacity*sizeof(Task)字节. 需要在loop()之前调用
+    */
+    MultiEventLoops &setMailboxes(size_t capacity = 1024);
+    // key所属的分片, 按std::hash<K>取模
+    template <class K>
+    int shardOf(const K &key) {
+        return std::hash<K>()(key) % loops_.size();
+    }
+    template <class K>
+    EventLoop &shard(const K &key) {
+        return loops_[shardOf(key)];
+    }
+    // 所有EventLoop的运行统计, 下标与getLoop一致. 可在任意线程调用
+    std::vector<LoopStats::Snapshot> stats() {
+        std::vector<LoopStats::Snapshot> r;
+        for (auto &b : loops_) {
+            r.push_back(b.stats());
+        }
+        return r;
+    }
     MultiEventLoops &exit() {
         for (auto &b : loops_) {
             b.exit();
@@ -107,8 +377,11 @@ struct MultiEventLoops : public EventLoopBases {
 
    private:
     std::atomic<int> id_;
+    std::vector<std::unique_ptr<SpscQueue<Task>>> mailboxes_; // 第i*size()+j个为分片i发给分片j的信箱, 在loops_之后析构
     std::vector<EventLoop> loops_;
     std::vector<std::thread> threads_;
+    Selector selector_;
+    bool excludeAcceptor_;
 };
 
 }  // namespace titan
@@ -0,0 +1,242 @@
+#include "hot_restart.h"
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "channel.h"
+#include "logging.h"
+
+namespace titan {
+
+namespace {
+
+const int kMaxFds = 250; // 单个SCM_RIGHTS消息的fd个数上限为253
+
+bool unixAddr(const std::string &path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    if (path.size() >= sizeof addr->sun_path) {
+        error("unix socket path too long: %s", path.c_str());
+        return false;
+    }
+    memcpy(addr->sun_path, path.data(), path.size());
+    return true;
+}
+
+void drainCheck(EventLoopBases *bases, int64_t deadline, const std::function<void()> &cb) {
+    int conns = 0;
+    for (int i = 0; i < bases->loopCount(); i++) {
+        conns += bases->loopAt(i)->connections();
+    }
+    EventLoop *loop = bases->loopAt(0);
+    if (conns == 0 || loop->now() >= deadline) {
+        if (conns) {
+            warn("drain timeout, %d connections left", conns);
+        }
+        cb();
+        return;
+    }
+    loop->runAfter(100, [=] { drainCheck(bases, deadline, cb); });
+}
+
+}  // namespace
+
+HotRestart::HotRestart(EventLoop *loop, const std::string &path)
+    : loop_(loop), path_(path), oldFd_(-1), listener_(NULL), peer_(NULL), handedOff_(false) {}
+
+HotRestart::~HotRestart() {
+    if (oldFd_ >= 0) {
+        close(oldFd_);
+    }
+    delete peer_;
+    if (listener_) {
+        delete listener_;
+        unlink(path_.c_str()); // 交给新进程之后path属于新进程, 不能删除
+    }
+}
+
+std::vector<std::vector<int>> HotRestart::takeover(int timeoutMs) {
+    std::vector<std::vector<int>> result;
+    struct sockaddr_un addr;
+    if (!unixAddr(path_, &addr)) {
+        return result;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    fatalif(fd < 0, "socket failed %d(%s)", errno, strerror(errno));
+    if (connect(fd, (struct sockaddr *) &addr, sizeof addr)) {
+        info("no running process at %s: %d(%s)", path_.c_str(), errno, strerror(errno));
+        close(fd);
+        return result;
+    }
+    struct pollfd pfd = {fd, POLLIN, 0};
+    char buf[1024];
+    union {
+        struct cmsghdr hdr;
+        char space[CMSG_SPACE(sizeof(int) * kMaxFds)];
+    } ctl;
+    struct iovec iov = {buf, sizeof buf - 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.space;
+    msg.msg_controllen = sizeof ctl.space;
+    int r = poll(&pfd, 1, timeoutMs);
+    ssize_t n = r > 0 ? recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) : -1;
+    if (n <= 0) {
+        error("receive listening sockets from %s failed %d(%s)", path_.c_str(), r == 0 ? ETIMEDOUT : errno, strerror(r == 0 ? ETIMEDOUT : errno));
+        close(fd);
+        return result;
+    }
+    std::vector<int> fds;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            int *p = (int *) CMSG_DATA(c);
+            fds.insert(fds.end(), p, p + (c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        }
+    }
+    // 消息格式: "titan-handoff <server个数> <每个server的socket个数>..."
+    buf[n] = 0;
+    char *p = buf;
+    size_t total = 0;
+    bool ok = strncmp(p, "titan-handoff ", 14) == 0 && !(msg.msg_flags & MSG_CTRUNC);
+    long servers = ok ? strtol(p + 14, &p, 10) : 0;
+    for (long i = 0; ok && i < servers; i++) {
+        long c = strtol(p, &p, 10);
+        ok = c >= 0 && total + c <= fds.size();
+        if (ok) {
+            result.push_back(std::vector<int>(fds.begin() + total, fds.begin() + total + c));
+            total += c;
+        }
+    }
+    if (!ok || total != fds.size()) {
+        error("bad handoff message from %s: %s", path_.c_str(), buf);
+        for (int f : fds) {
+            close(f);
+        }
+        close(fd);
+        result.clear();
+        return result;
+    }
+    info("received %zu listening sockets of %zu servers from %s", fds.size(), result.size(), path_.c_str());
+    oldFd_ = fd;
+    return result;
+}
+
+int HotRestart::serve(const std::vector<TcpServer *> &servers, const std::function<void()> &onHandoff) {
+    servers_ = servers;
+    onHandoff_ = onHandoff;
+    if (oldFd_ >= 0) { // 已经adopt了旧进程的socket, 通知旧进程停止accept
+        ssize_t w = write(oldFd_, "ready", 5);
+        if (w != 5) {
+            error("notify old process failed %d(%s)", errno, strerror(errno));
+        }
+        close(oldFd_);
+        oldFd_ = -1;
+    }
+    struct sockaddr_un addr;
+    if (!unixAddr(path_, &addr)) {
+        return EINVAL;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    fatalif(fd < 0, "socket failed %d(%s)", errno, strerror(errno));
+    unlink(path_.c_str()); // 旧进程的path, 旧进程已经不再使用
+    if (::bind(fd, (struct sockaddr *) &addr, sizeof addr) || listen(fd, 4)) {
+        int err = errno;
+        error("listen at %s failed %d(%s)", path_.c_str(), err, strerror(err));
+        close(fd);
+        return err;
+    }
+    listener_ = new Channel(loop_, fd, kReadEvent);
+    listener_->setReadCallback([this] { handleConnect(); });
+    info("waiting for hot restart at %s", path_.c_str());
+    return 0;
+}
+
+void HotRestart::handleConnect() {
+    int fd = listener_->fd() >= 0 ? accept4(listener_->fd(), NULL, NULL, SOCK_CLOEXEC) : -1;
+    if (fd < 0) {
+        return;
+    }
+    if (peer_ || handedOff_) { // 同一时刻只交给一个新进程
+        warn("hot restart already in progress, rejecting another process");
+        close(fd);
+        return;
+    }
+    std::string head = util::format("titan-handoff %zu", servers_.size());
+    std::vector<int> fds;
+    for (TcpServer *s : servers_) {
+        std::vector<int> sfds = s->listenFds();
+        head += util::format(" %zu", sfds.size());
+        fds.insert(fds.end(), sfds.begin(), sfds.end());
+    }
+    union {
+        struct cmsghdr hdr;
+        char space[CMSG_SPACE(sizeof(int) * kMaxFds)];
+    } ctl;
+    struct iovec iov = {(void *) head.data(), head.size()};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fds.size() > (size_t) kMaxFds) {
+        error("too many listening sockets to hand off: %zu", fds.size());
+        close(fd);
+        return;
+    }
+    if (fds.size()) {
+        msg.msg_control = ctl.space;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(c), fds.data(), sizeof(int) * fds.size());
+    }
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t) head.size()) {
+        error("send listening sockets failed %d(%s)", errno, strerror(errno));
+        close(fd);
+        return;
+    }
+    info("sent %zu listening sockets to new process", fds.size());
+    peer_ = new Channel(loop_, fd, kReadEvent);
+    peer_->setReadCallback([this] { handlePeer(); });
+}
+
+void HotRestart::handlePeer() {
+    if (peer_->fd() < 0) { // Channel::close() => handleRead()
+        return;
+    }
+    char buf[16];
+    ssize_t n = read(peer_->fd(), buf, sizeof buf);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    bool ready = n == 5 && memcmp(buf, "ready", 5) == 0;
+    if (!ready) {
+        warn("new process exited before taking over, keep accepting");
+    }
+    loop_->safeCall([this, ready] { // 不在channel自己的回调中释放channel
+        delete peer_;
+        peer_ = NULL;
+        if (!ready) {
+            return;
+        }
+        info("listening sockets handed off, stop accepting");
+        handedOff_ = true;
+        delete listener_;
+        listener_ = NULL;
+        for (TcpServer *s : servers_) {
+            s->stopAccept();
+        }
+        if (onHandoff_) {
+            onHandoff_();
+        }
+    });
+}
+
+void HotRestart::drain(EventLoopBases *bases, int64_t timeoutMs, const std::function<void()> &cb) {
+    EventLoop *loop = bases->loopAt(0);
+    loop->safeCall([=] { drainCheck(bases, loop->now() + timeoutMs, cb); });
+}
+
+}  // namespace titan
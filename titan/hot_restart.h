@@ -0,0 +1,42 @@
+#pragma once
+#include "tcp_server.h"
+
+namespace titan {
+
+/* 热重启: 旧进程通过Unix socket把监听socket(SCM_RIGHTS)交给新进程, 端口一直处于监听状态, 重启期间的连接请求不会被拒绝,
+   旧进程accept队列中还未accept的连接由新进程accept.
+    1. 新进程启动时调用takeover(), 连接path上的旧进程并接收监听socket; 没有旧进程时返回空, 由新进程自己bind
+    2. 新进程用TcpServer::adopt使用收到的socket, 然后调用serve(), 通知旧进程并在path上等待下一次重启
+    3. 旧进程收到通知后对servers调用stopAccept(), 然后调用onHandoff, 通常在其中用drain等待已有的连接结束后退出.
+       新进程在通知之前退出时, 旧进程继续accept
+
+    HotRestart hr(&loop, "/tmp/svr.sock");
+    std::vector<std::vector<int>> fds = hr.takeover();
+    int r = fds.empty() ? svr.bind("", 8081) : svr.adopt(fds[0]);
+    hr.serve({&svr}, [&] { HotRestart::drain(&loop, 10000, [&] { loop.exit(); }); });
+*/
+struct HotRestart : private noncopyable {
+    HotRestart(EventLoop *loop, const std::string &path);
+    ~HotRestart();
+    // 新进程: 从旧进程接收监听socket, 第i项为旧进程serve的第i个TcpServer的socket. 在loop()之前调用, 最多阻塞timeoutMs
+    std::vector<std::vector<int>> takeover(int timeoutMs = 3000);
+    // 在path上等待下一个新进程, 把servers的监听socket交给它. return 0 on sucess, errno on error
+    int serve(const std::vector<TcpServer *> &servers, const std::function<void()> &onHandoff);
+    // 监听socket是否已经交给新进程
+    bool handedOff() { return handedOff_; }
+    // bases中的所有连接关闭或者超过timeoutMs之后, 在bases的第一个EventLoop中调用cb. 连接数包括本进程作为客户端的连接
+    static void drain(EventLoopBases *bases, int64_t timeoutMs, const std::function<void()> &cb);
+
+   private:
+    EventLoop *loop_;
+    std::string path_;
+    int oldFd_; // 新进程中与旧进程的连接, serve时通知旧进程
+    Channel *listener_, *peer_; // peer_为旧进程中与新进程的连接
+    bool handedOff_;
+    std::vector<TcpServer *> servers_;
+    std::function<void()> onHandoff_;
+    void handleConnect();
+    void handlePeer();
+};
+
+}  // namespace titan
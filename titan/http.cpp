@@ -145,7 +145,9 @@ int HttpResponse::encode(Buffer &buf) {
     for (auto &hd : headers) {
         buf.append(hd.first).append(": ").append(hd.second).append("\r\n");
     }
-    buf.append("Connection: Keep-Alive\r\n");
+    if (!headers.count("Connection")) {
+        buf.append("Connection: Keep-Alive\r\n");
+    }
     snprintf(conlen, sizeof conlen, "Content-Length: %lu\r\n", getBody().size());
     buf.append(conlen);
     buf.append("\r\n").append(getBody());
@@ -195,7 +197,7 @@ void HttpConnPtr::handleRead(const HttpCallback &cb) const {
         if (r == HttpMsg::Complete) {
             info("http response: %d %s", resp.status, resp.statusWord.c_str());
             trace("http response:\n%.*s", (int) tcp->input_.size(), tcp->input_.data());
-            cb(tcp);
+            cb(*this);
         }
     } else {  // server
         HttpRequest &req = getRequest();
@@ -209,7 +211,7 @@ void HttpConnPtr::handleRead(const HttpCallback &cb) const {
         } else if (r == HttpMsg::Complete) {
             info("http request: %s %s %s", req.method.c_str(), req.query_uri.c_str(), req.version.c_str());
             trace("http request:\n%.*s", (int) tcp->input_.size(), tcp->input_.data());
-            cb(tcp);
+            cb(*this);
         }
     } 
 }
@@ -241,6 +243,9 @@ HttpServer::HttpServer(EventLoopBases *bases) : TcpServer(bases) {
         HttpConnPtr hcon(TcpConnPtr(new TcpConn));
         hcon.setHttpMsgCallback([this](const HttpConnPtr &hcon) {
             HttpRequest &req = hcon.getRequest();
+            if (!accepting()) {
+                hcon.closeAfterResponse();
+            }
             auto p = cbs_.find(req.method);
             if (p != cbs_.end()) {
                 auto p2 = p->second.find(req.uri);
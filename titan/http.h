@@ -106,11 +106,20 @@ struct HttpConnPtr {
         tcp->sendOutput();
     }
     void sendResponse(HttpResponse &resp) const {
+        bool closing = tcp->internalCtx_.context<HttpContext>().closing;
+        if (closing) {
+            resp.headers["Connection"] = "close";
+        }
         resp.encode(tcp->getOutput());
         logOutput("http resp");
         clearData();
         tcp->sendOutput();
+        if (closing) {
+            tcp->closeAfterFlush(); // 写到EAGAIN或者合并发送时output_中还有数据
+        }
     }
+    // 下一个响应带上Connection: close, 发送之后关闭连接
+    void closeAfterResponse() const { tcp->internalCtx_.context<HttpContext>().closing = true; }
     //文件作为Response
     void sendFile(const std::string &filename) const;
     void clearData() const;
@@ -121,6 +130,7 @@ struct HttpConnPtr {
     struct HttpContext {
         HttpRequest req;
         HttpResponse resp;
+        bool closing = false; // 发送响应之后关闭连接, 服务器停止accept之后设置
     };
     void handleRead(const HttpCallback &cb) const;
     void logOutput(const char *title) const;
@@ -128,7 +138,7 @@ struct HttpConnPtr {
 
 typedef HttpConnPtr::HttpCallback HttpCallback;
 
-// http服务器
+// http服务器. stopAccept之后对每个请求的响应带上Connection: close并关闭连接, 使keep-alive连接尽快结束
 struct HttpServer : public TcpServer {
     HttpServer(EventLoopBases *base);
     void setGetCallback(const std::string &uri, const HttpCallback &cb) { cbs_["GET"][uri] = cb; }
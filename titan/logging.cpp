@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -97,6 +98,7 @@ void Logger::maybeRotate() {
 }
 
 static thread_local uint64_t tid;
+static int resetTidOnFork = pthread_atfork(NULL, NULL, [] { tid = 0; }); // fork出的子进程(如Prefork的worker)重新获取线程id
 void Logger::logv(int level, const char *file, int line, const char *func, const char *fmt...) {
     if (tid == 0) {
         tid = port::gettid();
@@ -1,5 +1,10 @@
 #include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include "tcp_conn.h"
 #include "event_loop.h"
 #include "logging.h"
@@ -8,9 +13,36 @@
 
 namespace titan {
 
-EpollPoller::EpollPoller() : lastActive_(-1) {
+PollerBase::PollerBase() {
     static std::atomic<int64_t> id(0);
     id_ = id++;
+}
+
+void PollerBase::startRecv(Channel *ch) {
+    fatal("poller %lld doesn't support completion io", (long long) id_);
+}
+
+void PollerBase::startAccept(Channel *ch) {
+    fatal("poller %lld doesn't support completion io", (long long) id_);
+}
+
+void PollerBase::startSend(Channel *ch, const char *buf, size_t len) {
+    fatal("poller %lld doesn't support completion io", (long long) id_);
+}
+
+PollerBase *createPoller(PollerType type) {
+    if (type == PollerType::Uring) {
+        UringPoller *p = new UringPoller();
+        if (p->ok()) {
+            return p;
+        }
+        delete p;
+        warn("io_uring unavailable, use epoll instead");
+    }
+    return new EpollPoller();
+}
+
+EpollPoller::EpollPoller() : lastActive_(-1), idleRounds_(0), activeEvs_(kMinEvents) {
     epfd_ = epoll_create1(EPOLL_CLOEXEC);
     fatalif(epfd_ < 0, "epoll_create error %d(%s)", errno, strerror(errno));
     info("poller epoll %d created", epfd_);
@@ -18,65 +50,108 @@ EpollPoller::EpollPoller() : lastActive_(-1) {
 
 EpollPoller::~EpollPoller() { // 销毁poller的同时会销毁掉poller所关注的channel
     info("destroying poller %d", epfd_);
-    while (liveChannels_.size()) {
-        (*liveChannels_.begin())->close(); // Channel::close();
+    for (size_t fd = 0; fd < slots_.size(); fd++) { // 关闭的回调中可能关闭或创建其他channel, 每次重新读取
+        while (slots_[fd].ch) {
+            slots_[fd].ch->close(); // Channel::close();
+        }
     }
     ::close(epfd_);
     info("poller %d destroyed", epfd_);
 }
 
+std::vector<Channel *> EpollPoller::channels() {
+    std::vector<Channel *> r;
+    for (Slot &s : slots_) {
+        if (s.ch) {
+            r.push_back(s.ch);
+        }
+    }
+    return r;
+}
+
 void EpollPoller::addChannel(Channel *ch) {
+    if ((size_t) ch->fd() >= slots_.size()) {
+        slots_.resize(std::max((size_t) ch->fd() + 1, slots_.size() * 2), Slot{NULL, 0});
+    }
+    Slot &s = slots_[ch->fd()];
+    fatalif(s.ch, "fd %d already added to epoll %d", ch->fd(), epfd_);
+    s.ch = ch;
+    s.gen++;
     struct epoll_event ev;
     memset(&ev, 0, sizeof(ev));
     ev.events = ch->events();
-    ev.data.ptr = ch;
+    ev.data.u64 = token(ch->fd());
     trace("adding channel %lld fd %d events %d epoll %d", (long long) ch->id(), ch->fd(), ev.events, epfd_);
     int r = epoll_ctl(epfd_, EPOLL_CTL_ADD, ch->fd(), &ev);
     fatalif(r, "epoll_ctl add failed %d(%s)", errno, strerror(errno));
-    liveChannels_.insert(ch);
 }
 
 void EpollPoller::updateChannel(Channel *ch) {
     struct epoll_event ev;
     memset(&ev, 0, sizeof(ev));
     ev.events = ch->events();
-    ev.data.ptr = ch;
+    ev.data.u64 = token(ch->fd());
     trace("modifying channel %lld fd %d events read %d write %d epoll %d", (long long) ch->id(), ch->fd(), ev.events & EPOLLIN, ev.events & EPOLLOUT, epfd_);
     int r = epoll_ctl(epfd_, EPOLL_CTL_MOD, ch->fd(), &ev);
     fatalif(r, "epoll_ctl mod failed %d(%s)", errno, strerror(errno));
 }
 
+void EpollPoller::detachChannel(Channel *ch) {
+    trace("detaching channel %lld fd %d epoll %d", (long long) ch->id(), ch->fd(), epfd_);
+    int r = epoll_ctl(epfd_, EPOLL_CTL_DEL, ch->fd(), NULL);
+    fatalif(r, "epoll_ctl del failed %d(%s)", errno, strerror(errno));
+    removeChannel(ch);
+}
+
 /* Close a file descriptor(!all fd refers to the same open file discription is closed) 
     will automatically removed it from an epoll set
 */
 void EpollPoller::removeChannel(Channel *ch) {
     trace("removing channel %lld fd %d epoll %d", (long long) ch->id(), ch->fd(), epfd_);
-    liveChannels_.erase(ch); // 删除ch指针
-    for (int i = lastActive_ - 1; i >= 0; i--) {
-        if (ch == activeEvs_[i].data.ptr) {
-            activeEvs_[i].data.ptr = NULL;
-            break;
+    if ((ch->events() & EPOLLEXCLUSIVE) && ch->fd() >= 0) { // 共享同一个socket的其他fd没有关闭, close不会把fd移出epoll
+        epoll_ctl(epfd_, EPOLL_CTL_DEL, ch->fd(), NULL);
+    }
+    Slot &s = slots_[ch->fd()];
+    s.ch = NULL;
+    s.gen++; // 已返回的事件, 包括正在处理的事件都失效, 写回调中关闭的channel不再处理读事件
+}
+
+int EpollPoller::poll(int waitMs) {
+    int n = epoll_wait(epfd_, activeEvs_.data(), activeEvs_.size(), waitMs);
+    trace("epoll wait %d return %d errno %d(%s)", waitMs, n, errno, strerror(errno));
+    fatalif(n == -1 && errno != EINTR, "epoll return error %d(%s)", errno, strerror(errno));
+    int cap = activeEvs_.size();
+    if (n == cap && cap < kMaxEvents) { // 事件可能没有取完, 下次多取一些
+        activeEvs_.resize(std::min(cap * 2, kMaxEvents));
+        idleRounds_ = 0;
+    } else if (n < cap / 4 && cap > kMinEvents) {
+        if (++idleRounds_ >= 1000) { // 负载持续降低之后才缩小, 避免来回调整
+            activeEvs_.resize(cap / 2);
+            activeEvs_.shrink_to_fit();
+            idleRounds_ = 0;
         }
+    } else {
+        idleRounds_ = 0;
     }
+    lastActive_ = n;
+    return n;
 }
 
-void EpollPoller::loop_once(int waitMs) {
-    int64_t ticks = util::timeMilli();
-    lastActive_ = epoll_wait(epfd_, activeEvs_, kMaxEvents, waitMs);
-    int64_t used = util::timeMilli() - ticks;
-    trace("epoll wait %d return %d errno %d(%s) used %lld millsecond", waitMs, lastActive_, errno, strerror(errno), (long long) used);
-    fatalif(lastActive_ == -1 && errno != EINTR, "epoll return error %d(%s)", errno, strerror(errno));
+void EpollPoller::dispatch() {
     while (--lastActive_ >= 0) {
         int i = lastActive_;
-        Channel *ch = (Channel *) activeEvs_[i].data.ptr;
+        uint64_t tk = activeEvs_[i].data.u64;
+        Channel *ch = lookup(tk);
         int events = activeEvs_[i].events;
         if (ch) { // 若在epoll_wait返回后, removeChannel(ch), 则此时ch==NULL
-            if (events & kWriteEvent) {
+            if ((events & kWriteEvent) && ch->writeEnabled()) { // 边沿触发的channel始终有可写事件
                 trace("channel %lld fd %d handle write", (long long) ch->id(), ch->fd());
+                ch->getLoop()->setRunning(EventLoop::RunWrite, ch->id(), ch->fd());
                 ch->handleWrite();
             }
-            if (events & kReadEvent) {
+            if ((events & kReadEvent) && lookup(tk)) {
                 trace("channel %lld fd %d handle read", (long long) ch->id(), ch->fd());
+                ch->getLoop()->setRunning(EventLoop::RunRead, ch->id(), ch->fd());
                 ch->handleRead();
             }
             if (!(events & (kReadEvent | kWriteEvent))){
@@ -85,4 +160,504 @@ void EpollPoller::loop_once(int waitMs) {
         }
     }
 }
-}  // namespace titan
\ No newline at end of file
+
+static int uringSetup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uringEnter(int fd, unsigned submit, unsigned minComplete, unsigned flags, void *arg, size_t argsz) {
+    return (int) syscall(__NR_io_uring_enter, fd, submit, minComplete, flags, arg, argsz);
+}
+
+UringPoller::UringPoller()
+    : ringFd_(-1), sqes_(NULL), cqes_(NULL), sqRing_(MAP_FAILED), cqRing_(MAP_FAILED), sqRingSize_(0), cqRingSize_(0), sqesSize_(0), sqEntries_(0), nextToken_(1), completion_(false), bufRing_(NULL), bufs_(NULL), bufTail_(0),
+      lastActive_(-1) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    // 只有本线程提交和收割, 不需要内核打断线程执行完成任务, 在下次io_uring_enter时执行即可
+    p.flags = IORING_SETUP_CLAMP | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    int fd = uringSetup(1024, &p);
+    if (fd < 0 && errno == EINVAL) { // 5.19之前的内核不支持后两个标志
+        memset(&p, 0, sizeof p);
+        p.flags = IORING_SETUP_CLAMP;
+        fd = uringSetup(1024, &p);
+    }
+    if (fd < 0) {
+        info("io_uring_setup failed %d(%s)", errno, strerror(errno));
+        return;
+    }
+    // multishot poll和POLL_REMOVE更新事件需要5.13, 与其同时出现的特性是RSRC_TAGS
+    unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_RSRC_TAGS;
+    if ((p.features & need) != need) {
+        info("io_uring features %x lacks %x", p.features, need & ~p.features);
+        ::close(fd);
+        return;
+    }
+    sqRingSize_ = std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned), p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+    sqRing_ = mmap(NULL, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    sqesSize_ = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = sqRing_ == MAP_FAILED ? MAP_FAILED : mmap(NULL, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        error("io_uring mmap failed %d(%s)", errno, strerror(errno));
+        if (sqRing_ != MAP_FAILED) {
+            munmap(sqRing_, sqRingSize_);
+            sqRing_ = MAP_FAILED;
+        }
+        ::close(fd);
+        return;
+    }
+    cqRing_ = sqRing_; // SINGLE_MMAP, 两个队列在同一个映射中
+    char *sq = (char *) sqRing_, *cq = (char *) cqRing_;
+    sqHead_ = (unsigned *) (sq + p.sq_off.head);
+    sqTail_ = (unsigned *) (sq + p.sq_off.tail);
+    sqMask_ = (unsigned *) (sq + p.sq_off.ring_mask);
+    sqArray_ = (unsigned *) (sq + p.sq_off.array);
+    cqHead_ = (unsigned *) (cq + p.cq_off.head);
+    cqTail_ = (unsigned *) (cq + p.cq_off.tail);
+    cqMask_ = (unsigned *) (cq + p.cq_off.ring_mask);
+    cqes_ = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    sqes_ = (struct io_uring_sqe *) sqes;
+    sqEntries_ = p.sq_entries;
+    for (unsigned i = 0; i < sqEntries_; i++) { // 提交队列的下标与sqe一一对应, 之后不再修改
+        sqArray_[i] = i;
+    }
+    ringFd_ = fd;
+    completion_ = setupBufRing();
+    info("poller io_uring %d created sq %u cq %u completion io %d", ringFd_, p.sq_entries, p.cq_entries, completion_);
+}
+
+// multishot recv与SEND_ZC同在6.0加入, 用probe检查SEND_ZC判断是否支持, 之后注册provided buffer ring
+bool UringPoller::setupBufRing() {
+    std::vector<char> pb(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+    struct io_uring_probe *probe = (struct io_uring_probe *) pb.data();
+    int r = (int) syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_PROBE, probe, 256);
+    if (r < 0 || probe->last_op < IORING_OP_SEND_ZC || !(probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED)) {
+        info("io_uring lacks multishot recv, use readiness only");
+        return false;
+    }
+    void *ring = mmap(NULL, kRecvBufs * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *bufs = mmap(NULL, (size_t) kRecvBufs * kRecvBufSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uint64_t) ring;
+    reg.ring_entries = kRecvBufs;
+    reg.bgid = 0;
+    if (ring == MAP_FAILED || bufs == MAP_FAILED || syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        error("io_uring provided buffer ring failed %d(%s), use readiness only", errno, strerror(errno));
+        if (ring != MAP_FAILED) {
+            munmap(ring, kRecvBufs * sizeof(struct io_uring_buf));
+        }
+        if (bufs != MAP_FAILED) {
+            munmap(bufs, (size_t) kRecvBufs * kRecvBufSize);
+        }
+        return false;
+    }
+    bufRing_ = (struct io_uring_buf_ring *) ring;
+    bufs_ = (char *) bufs;
+    for (unsigned i = 0; i < kRecvBufs; i++) {
+        recycleBuf(i);
+    }
+    publishBufs();
+    return true;
+}
+
+void UringPoller::recycleBuf(int bid) {
+    // 不能用bufRing_->bufs: 头文件中柔性数组前的空结构在C++中占1字节, bufs的偏移是8而不是0
+    struct io_uring_buf *b = (struct io_uring_buf *) bufRing_ + (bufTail_ & (kRecvBufs - 1));
+    b->addr = (uint64_t) bufData(bid); // 第一项的resv是ring的tail, 不能整体赋值
+    b->len = kRecvBufSize;
+    b->bid = bid;
+    bufTail_++;
+}
+
+UringPoller::~UringPoller() {
+    if (ringFd_ < 0) {
+        return;
+    }
+    info("destroying poller %d", ringFd_);
+    while (channelTokens_.size()) {
+        channelTokens_.begin()->first->close(); // Channel::close();
+    }
+    munmap(sqes_, sqesSize_);
+    munmap(sqRing_, sqRingSize_);
+    ::close(ringFd_); // 关闭io_uring会取消所有poll请求. 接收和发送请求在关闭channel时已经结束
+    if (bufRing_) {
+        munmap(bufRing_, kRecvBufs * sizeof(struct io_uring_buf));
+        munmap(bufs_, (size_t) kRecvBufs * kRecvBufSize);
+    }
+    info("poller %d destroyed", ringFd_);
+}
+
+/* 提交sq中的请求直到剩余数不超过keep. 完成队列满(包括内核中溢出的事件)时返回EBUSY, 这时把完成事件移到backlog_中,
+   腾出空间之后重试, 之后的reap先处理backlog_
+*/
+void UringPoller::submit(unsigned keep) {
+    for (;;) {
+        unsigned pending = *sqTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+        if (pending <= keep) {
+            return;
+        }
+        int r = uringEnter(ringFd_, pending, 0, 0, NULL, 0);
+        if (r < 0 && errno == EBUSY) {
+            stashCompletions();
+        } else {
+            fatalif(r < 0 && errno != EINTR && errno != EAGAIN, "io_uring_enter submit failed %d(%s)", errno, strerror(errno));
+        }
+    }
+}
+
+void UringPoller::stashCompletions() {
+    unsigned head = *cqHead_;
+    unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        backlog_.push_back(cqes_[head & *cqMask_]);
+    }
+    __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe *UringPoller::getSqe() {
+    submit(sqEntries_ - 1); // 提交队列已满时先提交, 直到有空位
+    unsigned tail = *sqTail_;
+    struct io_uring_sqe *sqe = &sqes_[tail & *sqMask_];
+    memset(sqe, 0, sizeof *sqe);
+    __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE); // 内核在io_uring_enter时才读取, 之后填写sqe的内容也是安全的
+    return sqe;
+}
+
+std::vector<Channel *> UringPoller::channels() {
+    std::vector<Channel *> r;
+    for (auto &it : channelTokens_) {
+        r.push_back(it.first);
+    }
+    return r;
+}
+
+void UringPoller::addPoll(Channel *ch, Tokens &t) {
+    uint64_t token = nextToken_++;
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ch->fd();
+    sqe->poll32_events = ch->events() & (kReadEvent | kWriteEvent);
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = token;
+    tokens_[token] = Op{ch, IoPoll, (size_t) -1};
+    t.poll = token;
+}
+
+void UringPoller::removePoll(Tokens &t) {
+    if (t.poll) {
+        struct io_uring_sqe *sqe = getSqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = t.poll;
+        sqe->user_data = 0;
+        tokens_.erase(t.poll); // 之后到达的该请求的事件都被忽略
+        t.poll = 0;
+    }
+}
+
+void UringPoller::addIo(Channel *ch, Tokens &t) {
+    uint64_t token = nextToken_++;
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->fd = ch->fd();
+    sqe->user_data = token;
+    if (t.mode == IoRecv) { // 数据写入provided buffer, 缓冲区只在有数据时占用
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+    } else {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+    tokens_[token] = Op{ch, t.mode, (size_t) -1};
+    t.io = token;
+}
+
+void UringPoller::addChannel(Channel *ch) {
+    trace("adding channel %lld fd %d events %d io_uring %d", (long long) ch->id(), ch->fd(), ch->events(), ringFd_);
+    Tokens &t = channelTokens_[ch];
+    t = Tokens{nextToken_++, IoPoll, 0, 0, 0};
+    addPoll(ch, t);
+}
+
+void UringPoller::updateChannel(Channel *ch) {
+    trace("modifying channel %lld fd %d events read %d write %d io_uring %d", (long long) ch->id(), ch->fd(), ch->events() & kReadEvent, ch->events() & kWriteEvent, ringFd_);
+    auto it = channelTokens_.find(ch);
+    fatalif(it == channelTokens_.end(), "io_uring update unknown channel %lld", (long long) ch->id());
+    if (it->second.mode != IoPoll) { // 完成模式没有就绪通知
+        return;
+    }
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = it->second.poll;
+    sqe->len = IORING_POLL_UPDATE_EVENTS; // 原地更新事件, 保留multishot
+    sqe->poll32_events = ch->events() & (kReadEvent | kWriteEvent);
+    sqe->user_data = 0;
+}
+
+void UringPoller::startRecv(Channel *ch) {
+    startMultishot(ch, IoRecv);
+}
+
+void UringPoller::startAccept(Channel *ch) {
+    startMultishot(ch, IoAccept);
+}
+
+void UringPoller::startMultishot(Channel *ch, IoOp op) {
+    trace("channel %lld fd %d start %s io_uring %d", (long long) ch->id(), ch->fd(), op == IoRecv ? "recv" : "accept", ringFd_);
+    auto it = channelTokens_.find(ch);
+    fatalif(!completion_ || it == channelTokens_.end() || it->second.mode != IoPoll, "io_uring start completion io on channel %lld failed", (long long) ch->id());
+    removePoll(it->second);
+    it->second.mode = op;
+    addIo(ch, it->second);
+}
+
+void UringPoller::startSend(Channel *ch, const char *buf, size_t len) {
+    auto it = channelTokens_.find(ch);
+    fatalif(it == channelTokens_.end() || it->second.send, "io_uring send on channel %lld unknown or busy", (long long) ch->id());
+    uint64_t token = nextToken_++;
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = ch->fd();
+    sqe->addr = (uint64_t) buf;
+    sqe->len = std::min(len, (size_t) INT_MAX);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = token;
+    tokens_[token] = Op{ch, IoSend, (size_t) -1};
+    it->second.send = token;
+}
+
+void UringPoller::detachChannel(Channel *ch) {
+    trace("detaching channel %lld fd %d io_uring %d", (long long) ch->id(), ch->fd(), ringFd_);
+    removeChannel(ch, true);
+}
+
+void UringPoller::removeChannel(Channel *ch) {
+    trace("removing channel %lld fd %d io_uring %d", (long long) ch->id(), ch->fd(), ringFd_);
+    removeChannel(ch, false);
+}
+
+/* poll, recv等请求持有fd对应的文件, 删除请求不提交的话, close之后连接并不会关闭, 因此删除时立即提交.
+   与epoll_ctl删除相同, 每次一个系统调用. 有接收或发送请求时还要等待它们结束, 之后内核不再使用发送的数据.
+   deliver: 迁移channel时, 把取消之前已经完成的结果交给channel
+*/
+void UringPoller::removeChannel(Channel *ch, bool deliver) {
+    auto it = channelTokens_.find(ch);
+    if (it != channelTokens_.end()) {
+        removePoll(it->second);
+        if (it->second.io || it->second.send) {
+            quiesce(ch, deliver);
+        } else {
+            submit(0);
+        }
+        channelTokens_.erase(ch); // quiesce中的回调可能添加channel, it已经失效
+    }
+    for (int i = std::min(lastActive_, (int) active_.size() - 1); i >= 0; i--) { // 包括正在处理的事件
+        if (ch == active_[i].first) {
+            active_[i].first = NULL;
+            break;
+        }
+    }
+}
+
+// 取消channel的接收和发送请求, 等待它们的最后一个事件. 其他channel的事件移到backlog_, 在下次reap中处理
+void UringPoller::quiesce(Channel *ch, bool deliver) {
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = ch->fd();
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = 0;
+    submit(0);
+    size_t first = completions_.size();
+    std::vector<struct io_uring_cqe> cqes, others;
+    for (;;) {
+        cqes.swap(backlog_);
+        stashCompletions();
+        cqes.insert(cqes.end(), backlog_.begin(), backlog_.end());
+        backlog_.clear();
+        for (auto &cqe : cqes) {
+            auto op = tokens_.find(cqe.user_data);
+            if (cqe.user_data && op != tokens_.end() && op->second.ch == ch) {
+                handleCqe(&cqe);
+            } else {
+                others.push_back(cqe);
+            }
+        }
+        cqes.clear();
+        Tokens &t = channelTokens_.find(ch)->second;
+        if (!t.io && !t.send) {
+            break;
+        }
+        int r = uringEnter(ringFd_, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        fatalif(r < 0 && errno != EINTR && errno != EBUSY, "io_uring_enter wait failed %d(%s)", errno, strerror(errno));
+    }
+    backlog_.swap(others);
+    for (size_t i = first; i < completions_.size(); i++) {
+        Completion c = completions_[i];
+        if (deliver) {
+            ch->handleCompletion(c.op, c.res, c.buf >= 0 ? bufData(c.buf) : NULL);
+        }
+        if (c.buf >= 0) {
+            recycleBuf(c.buf);
+        }
+    }
+    completions_.resize(first);
+    publishBufs();
+}
+
+// 处理一个完成事件. 同一个channel的多个就绪事件合并, 完成的请求按顺序加入completions_
+void UringPoller::handleCqe(const struct io_uring_cqe *cqe) {
+    uint64_t token = cqe->user_data;
+    int bid = cqe->flags & IORING_CQE_F_BUFFER ? (int) (cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    auto it = token ? tokens_.find(token) : tokens_.end();
+    if (it == tokens_.end()) {
+        // 删除和更新请求的结果, 或者已删除的请求. POLL_REMOVE更新在请求已经结束时会失败, 那时也会收到不带F_MORE的事件, 在下面重新添加
+        if (bid >= 0) {
+            recycleBuf(bid);
+        }
+        return;
+    }
+    Channel *ch = it->second.ch;
+    IoOp op = it->second.op;
+    Tokens &t = channelTokens_.find(ch)->second;
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    if (op == IoSend) {
+        t.send = 0;
+        tokens_.erase(it);
+        completions_.push_back(Completion{ch, t.id, op, cqe->res, -1});
+        return;
+    }
+    if (op == IoRecv || op == IoAccept) {
+        if (!more) {
+            t.io = 0;
+            tokens_.erase(it);
+        }
+        if (cqe->res == -ENOBUFS || cqe->res == -ECANCELED) { // provided buffer用完时请求结束, 归还之后重新提交; 取消只发生在删除channel时
+            if (!more && cqe->res == -ENOBUFS) {
+                rearm_.push_back(std::make_pair(ch, t.id));
+            }
+            return;
+        }
+        completions_.push_back(Completion{ch, t.id, op, cqe->res, bid});
+        if (!more && (cqe->res > 0 || op == IoAccept)) { // 内核提前结束了multishot(比如完成队列溢出), 或者accept出错. 对端关闭和接收出错时不再提交
+            rearm_.push_back(std::make_pair(ch, t.id));
+        }
+        return;
+    }
+    int events = 0;
+    if (cqe->res > 0) {
+        events = cqe->res & (kReadEvent | kWriteEvent);
+        if (cqe->res & (POLLERR | POLLHUP)) { // 与epoll一致, 出错由读回调处理
+            events |= kReadEvent;
+        }
+    } else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+        error("channel %lld fd %d poll failed %d(%s)", (long long) ch->id(), ch->fd(), -cqe->res, strerror(-cqe->res));
+        events = kReadEvent;
+    }
+    if (events) {
+        size_t slot = it->second.slot;
+        if (slot < active_.size() && active_[slot].first == ch) {
+            active_[slot].second |= events;
+        } else {
+            it->second.slot = active_.size();
+            active_.push_back(std::make_pair(ch, events));
+        }
+    }
+    if (!more) { // multishot请求结束(出错或完成队列溢出), 重新添加
+        trace("channel %lld fd %d poll ended res %d, rearm", (long long) ch->id(), ch->fd(), cqe->res);
+        tokens_.erase(it);
+        addPoll(ch, t);
+    }
+}
+
+// 收割完成队列. handleCqe重新添加请求时可能把完成队列中剩余的事件移到backlog_, 每次都重新读取head并先处理backlog_
+int UringPoller::reap() {
+    active_.clear();
+    for (;;) {
+        if (backlog_.size()) {
+            std::vector<struct io_uring_cqe> backlog;
+            backlog.swap(backlog_);
+            for (auto &cqe : backlog) {
+                handleCqe(&cqe);
+            }
+            continue;
+        }
+        unsigned head = *cqHead_;
+        if (head == __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        struct io_uring_cqe cqe = cqes_[head & *cqMask_];
+        __atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+        handleCqe(&cqe);
+    }
+    return (int) (active_.size() + completions_.size());
+}
+
+int UringPoller::poll(int waitMs) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof arg);
+    arg.sigmask_sz = _NSIG / 8;
+    if (waitMs > 0) {
+        ts.tv_sec = waitMs / 1000;
+        ts.tv_nsec = (waitMs % 1000) * 1000000LL;
+        arg.ts = (uint64_t) &ts;
+    }
+    unsigned submit = *sqTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+    // 提交本轮积累的请求并等待事件, 只有一次系统调用
+    int r = uringEnter(ringFd_, submit, waitMs == 0 ? 0 : 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+    trace("io_uring wait %d submit %u return %d errno %d(%s)", waitMs, submit, r, errno, strerror(errno));
+    fatalif(r < 0 && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN, "io_uring_enter error %d(%s)", errno, strerror(errno));
+    int n = reap();
+    lastActive_ = (int) active_.size();
+    return n;
+}
+
+void UringPoller::dispatch() {
+    while (--lastActive_ >= 0) {
+        int i = lastActive_;
+        Channel *ch = active_[i].first;
+        int events = active_[i].second;
+        if (ch) {
+            if ((events & kWriteEvent) && ch->writeEnabled()) { // 边沿触发的channel始终有可写事件
+                trace("channel %lld fd %d handle write", (long long) ch->id(), ch->fd());
+                ch->getLoop()->setRunning(EventLoop::RunWrite, ch->id(), ch->fd());
+                ch->handleWrite();
+            }
+            if ((events & kReadEvent) && active_[i].first) {
+                trace("channel %lld fd %d handle read", (long long) ch->id(), ch->fd());
+                ch->getLoop()->setRunning(EventLoop::RunRead, ch->id(), ch->fd());
+                ch->handleRead();
+            }
+        }
+    }
+    for (size_t i = 0; i < completions_.size(); i++) { // 回调中删除的channel不在channelTokens_中, 或者id已经不同
+        Completion c = completions_[i];
+        auto it = channelTokens_.find(c.ch);
+        if (it != channelTokens_.end() && it->second.id == c.id) {
+            trace("channel %lld fd %d handle completion %d res %d", (long long) c.ch->id(), c.ch->fd(), c.op, c.res);
+            c.ch->getLoop()->setRunning(c.op == IoSend ? EventLoop::RunWrite : EventLoop::RunRead, c.ch->id(), c.ch->fd());
+            c.ch->handleCompletion(c.op, c.res, c.buf >= 0 ? bufData(c.buf) : NULL);
+        }
+        if (c.buf >= 0) {
+            recycleBuf(c.buf);
+        }
+    }
+    completions_.clear();
+    if (completion_) { // 先归还buffer, 因ENOBUFS结束的请求在之后重新提交
+        publishBufs();
+    }
+    std::vector<std::pair<Channel *, uint64_t>> rearm;
+    rearm.swap(rearm_);
+    for (auto &r : rearm) {
+        auto it = channelTokens_.find(r.first);
+        if (it != channelTokens_.end() && it->second.id == r.second && it->second.mode != IoPoll && !it->second.io) {
+            addIo(r.first, it->second);
+        }
+    }
+}
+
+}  // namespace titan
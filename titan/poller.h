@@ -4,30 +4,179 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
+#include <linux/io_uring.h>
 #include <atomic>
 #include <map>
+#include <unordered_map>
+#include <vector>
 
 namespace titan {
 
-const int kMaxEvents = 2000;
+const int kMaxEvents = 2000; // 一次poll最多返回的事件数
+const int kMinEvents = 64;
 const int kReadEvent = EPOLLIN;
 const int kWriteEvent = EPOLLOUT;
 
+enum class PollerType {
+    Epoll,
+    Uring,
+};
+
+// poller中的请求: 就绪通知, 以及基于完成的IO的接收, 发送和accept, 见PollerBase::completionIO
+enum IoOp {
+    IoPoll,
+    IoRecv,
+    IoSend,
+    IoAccept,
+};
+
 // poller class是IO multiplexing的封装, 每个EventLoop都有一个的poller
-struct EpollPoller : private noncopyable {
+struct PollerBase : private noncopyable {
+    PollerBase();
+    virtual ~PollerBase() {}
+    virtual void addChannel(Channel *ch) = 0;
+    virtual void removeChannel(Channel *ch) = 0;
+    virtual void updateChannel(Channel *ch) = 0;
+    // 把fd移出poller, fd保持打开, 之后可以加入其他poller
+    virtual void detachChannel(Channel *ch) = 0;
+    // 从poll返回到再次调用poll称为一次事件循环. poll等待事件, dispatch执行就绪channel的回调
+    virtual int poll(int waitMs) = 0;
+    virtual void dispatch() = 0;
+    virtual PollerType type() = 0;
+    // poller所关心的channel列表. 销毁poller的同时会关闭这些channel
+    virtual std::vector<Channel *> channels() = 0;
+
+    /* 基于完成的IO: 接收, 发送和accept由poller提交给内核, 结果通过Channel::handleCompletion返回.
+       只有内核支持时的UringPoller返回true, 其他poller调用下面的函数会出错
+    */
+    virtual bool completionIO() { return false; }
+    // 改为持续接收数据, channel不再产生就绪事件. 每次收到数据, 对端关闭或出错时以IoRecv调用handleCompletion
+    virtual void startRecv(Channel *ch);
+    // 改为持续accept, 每个新连接以IoAccept调用handleCompletion
+    virtual void startAccept(Channel *ch);
+    // 发送buf, 完成时以IoSend调用handleCompletion, 可能只发送了一部分. buf在完成之前必须有效, 每个channel同时只能有一个发送
+    virtual void startSend(Channel *ch, const char *buf, size_t len);
+
+    int64_t id_;
+};
+
+// 创建指定类型的poller, io_uring不可用时使用epoll
+PollerBase *createPoller(PollerType type);
+
+struct EpollPoller : public PollerBase {
     EpollPoller();
     ~EpollPoller();
-    void addChannel(Channel *ch);
-    void removeChannel(Channel *ch);
-    void updateChannel(Channel *ch);
-    // 从poll返回到再次调用poll称为一次事件循环
-    void loop_once(int waitMs);
+    void addChannel(Channel *ch) override;
+    void removeChannel(Channel *ch) override;
+    void updateChannel(Channel *ch) override;
+    void detachChannel(Channel *ch) override;
+    int poll(int waitMs) override;
+    void dispatch() override;
+    PollerType type() override { return PollerType::Epoll; }
+    std::vector<Channel *> channels() override;
 
-    int64_t id_;
     int epfd_; // epoll fd
-    std::set<Channel *> liveChannels_; // poller所关心的channel列表
-    int lastActive_; 
-    struct epoll_event activeEvs_[kMaxEvents]; // for epoll selected active events
+    /* 以fd为下标的channel表. 每次添加和删除时gen加1, 事件的data.u64中保存fd和添加时的gen,
+       不一致说明事件返回之后channel已被删除, 不再需要扫描activeEvs_
+    */
+    struct Slot {
+        Channel *ch;
+        uint32_t gen;
+    };
+    std::vector<Slot> slots_;
+    int lastActive_;
+    int idleRounds_; // 连续返回事件数不足activeEvs_四分之一的次数, 用于缩小activeEvs_
+    std::vector<struct epoll_event> activeEvs_; // for epoll selected active events, 长度在kMinEvents与kMaxEvents之间按负载调整
+    uint64_t token(int fd) { return (uint64_t) slots_[fd].gen << 32 | (uint32_t) fd; }
+    Channel *lookup(uint64_t token) {
+        Slot &s = slots_[(uint32_t) token];
+        return s.gen == token >> 32 ? s.ch : NULL;
+    }
+};
+
+/* 基于io_uring的poller, 直接使用系统调用, 不依赖liburing. 所有请求只写入提交队列, 在下一次poll时与等待合并为一次io_uring_enter.
+   普通channel使用就绪通知: 每个channel一个multishot的POLL_ADD, 关注的事件变化时用POLL_REMOVE更新, 省去了epoll中
+   每次修改一个epoll_ctl的系统调用. multishot poll在fd被唤醒时才产生事件, 相当于边沿触发, 回调需要读写到EAGAIN. 需要5.13以上的内核.
+   内核为6.0以上时还支持基于完成的IO(completionIO), TcpConn和TcpServer在连接建立后和监听时使用:
+   接收使用multishot recv, 数据由内核写入poller注册的provided buffer ring, 交给回调后归还; accept使用multishot accept;
+   发送提交SEND, 同一轮循环中的发送一起提交. 关闭或迁移channel时取消它的请求, 并等待内核结束这些请求之后才返回
+*/
+struct UringPoller : public PollerBase {
+    UringPoller();
+    ~UringPoller();
+    // 初始化成功
+    bool ok() { return ringFd_ >= 0; }
+    void addChannel(Channel *ch) override;
+    void removeChannel(Channel *ch) override;
+    void updateChannel(Channel *ch) override;
+    void detachChannel(Channel *ch) override;
+    int poll(int waitMs) override;
+    void dispatch() override;
+    PollerType type() override { return PollerType::Uring; }
+    std::vector<Channel *> channels() override;
+
+    bool completionIO() override { return completion_; }
+    void startRecv(Channel *ch) override;
+    void startAccept(Channel *ch) override;
+    void startSend(Channel *ch, const char *buf, size_t len) override;
+    static const unsigned kRecvBufs = 1024; // provided buffer的个数和大小, 所有连接共用
+    static const unsigned kRecvBufSize = 4096;
+
+   private:
+    int ringFd_;
+    unsigned *sqHead_, *sqTail_, *sqMask_, *sqArray_;
+    unsigned *cqHead_, *cqTail_, *cqMask_;
+    struct io_uring_sqe *sqes_;
+    struct io_uring_cqe *cqes_;
+    void *sqRing_, *cqRing_;
+    size_t sqRingSize_, cqRingSize_, sqesSize_;
+    unsigned sqEntries_;
+    uint64_t nextToken_; // 请求的user_data, 每次添加递增, 用于忽略已删除请求的事件. 0用于删除和更新请求
+    bool completion_;
+    struct io_uring_buf_ring *bufRing_; // provided buffer ring, 与bufs_一起在completion_时有效
+    char *bufs_;
+    unsigned short bufTail_; // 已加入bufRing_的buffer数, 在dispatch末尾发布给内核
+    struct Op {
+        Channel *ch;
+        IoOp op;
+        size_t slot; // IoPoll: 本次poll中在active_的位置, 同一channel的多个事件合并为一个
+    };
+    std::unordered_map<uint64_t, Op> tokens_;
+    // channel的请求, 0表示没有. id在加入poller时分配, 用于识别已删除的channel, 即使新的channel复用了地址
+    struct Tokens {
+        uint64_t id;
+        IoOp mode; // IoPoll为就绪通知, IoRecv, IoAccept为完成模式
+        uint64_t poll, io, send; // io为multishot recv或accept
+    };
+    std::unordered_map<Channel *, Tokens> channelTokens_;
+    std::vector<std::pair<Channel *, int>> active_;
+    int lastActive_;
+    // 完成的请求, 按完成的顺序在dispatch中交给channel. buf为provided buffer的序号, -1表示没有
+    struct Completion {
+        Channel *ch;
+        uint64_t id;
+        IoOp op;
+        int res;
+        int buf;
+    };
+    std::vector<Completion> completions_;
+    std::vector<std::pair<Channel *, uint64_t>> rearm_; // multishot请求结束(比如provided buffer用完)的channel, dispatch之后重新提交
+    std::vector<struct io_uring_cqe> backlog_; // 提交时为腾出完成队列而移出的事件
+    struct io_uring_sqe *getSqe();
+    void submit(unsigned keep);
+    void stashCompletions();
+    void addPoll(Channel *ch, Tokens &t);
+    void removePoll(Tokens &t);
+    void addIo(Channel *ch, Tokens &t);
+    void startMultishot(Channel *ch, IoOp op);
+    bool setupBufRing();
+    void recycleBuf(int bid);
+    void publishBufs() { __atomic_store_n(&bufRing_->tail, bufTail_, __ATOMIC_RELEASE); }
+    const char *bufData(int bid) { return bufs_ + (size_t) bid * kRecvBufSize; }
+    void quiesce(Channel *ch, bool deliver);
+    void removeChannel(Channel *ch, bool deliver);
+    void handleCqe(const struct io_uring_cqe *cqe);
+    int reap();
 };
 
 }  // namespace titan
\ No newline at end of file
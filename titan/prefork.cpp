@@ -0,0 +1,175 @@
+#include "prefork.h"
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "logging.h"
+
+namespace titan {
+
+Prefork::Prefork(int workers) : procs_(workers, Proc{0, 0, 0, 0}), stopTimeout_(10000), restarts_(0) {
+    sigemptyset(&oldMask_);
+}
+
+Prefork::~Prefork() {
+    for (auto &fds : fds_) {
+        for (int fd : fds) {
+            close(fd);
+        }
+    }
+}
+
+int Prefork::bind(const std::string &host, unsigned short port) {
+    Ip4Addr addr(host, port);
+    std::vector<int> fds;
+    for (size_t k = 0; k < procs_.size(); k++) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int r = fd < 0 ? -1 : net::setReuseAddr(fd);
+        r = r ? r : net::setReusePort(fd);
+        r = r ? r : ::bind(fd, (struct sockaddr *) &addr.getAddr(), sizeof(struct sockaddr));
+        r = r ? r : listen(fd, SOMAXCONN);
+        if (r) {
+            int err = errno;
+            error("listen at %s failed %d %s", addr.toString().c_str(), err, strerror(err));
+            if (fd >= 0) {
+                close(fd);
+            }
+            for (int f : fds) {
+                close(f);
+            }
+            return err;
+        }
+        fds.push_back(fd);
+    }
+    info("%zu reuseport sockets listening at %s", fds.size(), addr.toString().c_str());
+    fds_.push_back(fds);
+    return 0;
+}
+
+void Prefork::spawn(int i, const Worker &worker) {
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        error("fork worker %d failed %d %s", i, errno, strerror(errno));
+        procs_[i].restartAt = util::steadyMilli() + 1000;
+        return;
+    }
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM); // 父进程退出时worker随之退出
+        if (getppid() != parent) {
+            _exit(1);
+        }
+        pthread_sigmask(SIG_SETMASK, &oldMask_, NULL);
+        std::vector<int> fds;
+        for (auto &all : fds_) {
+            for (size_t k = 0; k < all.size(); k++) {
+                if ((int) k == i) {
+                    fds.push_back(all[k]);
+                } else {
+                    close(all[k]);
+                }
+            }
+        }
+        worker(i, fds);
+        exit(0);
+    }
+    procs_[i].pid = pid;
+    procs_[i].startedAt = util::steadyMilli();
+    info("worker %d started, pid %d", i, pid);
+}
+
+void Prefork::reap(bool stopping) {
+    for (size_t i = 0; i < procs_.size(); i++) {
+        Proc &p = procs_[i];
+        int status;
+        if (p.pid == 0 || waitpid(p.pid, &status, WNOHANG) != p.pid) {
+            continue;
+        }
+        int64_t now = util::steadyMilli();
+        if (WIFSIGNALED(status) && !stopping) {
+            warn("worker %zu pid %d killed by signal %d", i, p.pid, WTERMSIG(status));
+        } else if (WIFSIGNALED(status)) {
+            info("worker %zu pid %d killed by signal %d", i, p.pid, WTERMSIG(status));
+        } else if (WEXITSTATUS(status) && !stopping) {
+            warn("worker %zu pid %d exited with %d", i, p.pid, WEXITSTATUS(status));
+        } else {
+            info("worker %zu pid %d exited with %d", i, p.pid, WEXITSTATUS(status));
+        }
+        p.pid = 0;
+        if (stopping) {
+            continue;
+        }
+        if (now - p.startedAt >= 1000) { // 运行过一段时间, 立即重启
+            p.delay = 0;
+        } else {
+            p.delay = std::min(std::max(p.delay * 2, int64_t(100)), int64_t(5000));
+        }
+        p.restartAt = now + p.delay;
+        restarts_++;
+    }
+}
+
+void Prefork::run(const Worker &worker) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    int r = pthread_sigmask(SIG_BLOCK, &mask, &oldMask_); // 信号在下面的sigtimedwait中同步处理
+    fatalif(r, "pthread_sigmask failed %d(%s)", r, strerror(r));
+    for (size_t i = 0; i < procs_.size(); i++) {
+        spawn(i, worker);
+    }
+    bool stopping = false;
+    int64_t killAt = 0;
+    for (;;) {
+        reap(stopping);
+        int64_t now = util::steadyMilli();
+        int64_t next = now + 1000;
+        int alive = 0;
+        for (size_t i = 0; i < procs_.size(); i++) {
+            Proc &p = procs_[i];
+            if (p.pid == 0 && !stopping) {
+                if (p.restartAt > now) {
+                    next = std::min(next, p.restartAt);
+                    continue;
+                }
+                spawn(i, worker);
+            }
+            alive += p.pid != 0;
+        }
+        if (stopping) {
+            if (alive == 0) {
+                break;
+            }
+            if (now >= killAt) {
+                for (auto &p : procs_) {
+                    if (p.pid) {
+                        warn("worker pid %d not exited in %ld ms, killing it", p.pid, (long) stopTimeout_);
+                        kill(p.pid, SIGKILL);
+                    }
+                }
+                killAt = now + stopTimeout_;
+            }
+            next = std::min(next, killAt);
+        }
+        int64_t wait = std::max(next - now, int64_t(0));
+        struct timespec ts = {time_t(wait / 1000), long(wait % 1000 * 1000000)};
+        int sig = sigtimedwait(&mask, NULL, &ts);
+        if ((sig == SIGINT || sig == SIGTERM) && !stopping) {
+            info("supervisor got signal %d, stopping %d workers", sig, alive);
+            stopping = true;
+            for (auto &p : procs_) {
+                if (p.pid) {
+                    kill(p.pid, SIGTERM);
+                }
+            }
+            killAt = util::steadyMilli() + stopTimeout_;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldMask_, NULL);
+    info("all workers exited, %zu restarts", restarts_);
+}
+
+}  // namespace titan
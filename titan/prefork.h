@@ -0,0 +1,59 @@
+#pragma once
+#include <signal.h>
+#include <functional>
+#include <string>
+#include <vector>
+#include "util.h"
+
+namespace titan {
+
+/* 多进程服务: 父进程(supervisor)创建监听socket之后fork出多个worker进程, 每个worker运行自己的EventLoop或MultiEventLoops,
+   用TcpServer::adopt在继承的socket上accept. 每个worker一个设置了SO_REUSEPORT的socket, 由内核在worker之间分配连接,
+   worker之间不共享堆和锁. socket由父进程持有, worker退出时其accept队列中的连接留给重启后的worker.
+   worker退出后自动重启, 启动不到1秒就退出的worker延迟重启, 延迟从100ms开始每次加倍, 最长5秒.
+   父进程收到SIGINT/SIGTERM后向所有worker发送SIGTERM, 超过stopTimeout仍未退出的发送SIGKILL, 全部退出后run()返回.
+   fork时父进程中不应当有其他线程, 也不应当已经创建EventLoop
+
+    Prefork pf(4);
+    exitif(pf.bind("", 8081), "bind failed");
+    pf.run([](int index, const std::vector<int> &fds) { // 在worker进程中执行, fds[i]对应第i次bind
+        EventLoop loop;
+        HttpServer svr(&loop);
+        svr.adopt(fds[0]);
+        Signal::signal(SIGTERM, [&] { loop.exit(); });
+        loop.loop();
+    });
+*/
+struct Prefork : private noncopyable {
+    typedef std::function<void(int index, const std::vector<int> &fds)> Worker;
+    Prefork(int workers);
+    ~Prefork();
+    // 为每个worker创建一个监听host:port的socket, 可以调用多次监听多个地址. return 0 on sucess, errno on error
+    int bind(const std::string &host, unsigned short port);
+    // worker收到SIGTERM之后等待退出的时间
+    Prefork &setStopTimeout(int64_t ms) {
+        stopTimeout_ = ms;
+        return *this;
+    }
+    // 启动worker并在退出后重启, 直到收到SIGINT/SIGTERM并且所有worker退出. worker函数返回后worker进程以0退出
+    void run(const Worker &worker);
+    int workers() { return procs_.size(); }
+    // 重启的次数
+    size_t restarts() { return restarts_; }
+
+   private:
+    struct Proc {
+        pid_t pid; // 0表示未运行
+        int64_t startedAt, restartAt; // 毫秒
+        int64_t delay; // 下次快速退出后的重启延迟
+    };
+    std::vector<std::vector<int>> fds_; // fds_[i][k]为第i次bind给worker k的socket
+    std::vector<Proc> procs_;
+    int64_t stopTimeout_;
+    size_t restarts_;
+    sigset_t oldMask_; // run()之前的信号屏蔽字, 在worker中恢复
+    void spawn(int i, const Worker &worker);
+    void reap(bool stopping);
+};
+
+}  // namespace titan
@@ -0,0 +1,80 @@
+#include "stats.h"
+
+namespace titan {
+
+int64_t Histogram::Snapshot::percentile(double p) const {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t want = uint64_t(p * count);
+    want = want < count ? want + 1 : count;
+    uint64_t c = 0;
+    for (int i = 0; i < kBuckets; i++) {
+        c += buckets[i];
+        if (c >= want) {
+            int64_t upper = i ? (int64_t(1) << i) - 1 : 0;
+            return upper < int64_t(max) ? upper : max;
+        }
+    }
+    return max;
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+    Snapshot s;
+    s.count = count_.load(std::memory_order_relaxed);
+    s.sum = sum_.load(std::memory_order_relaxed);
+    s.max = max_.load(std::memory_order_relaxed);
+    for (int i = 0; i < kBuckets; i++) {
+        s.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+    }
+    return s;
+}
+
+void Histogram::clear() {
+    count_ = sum_ = max_ = 0;
+    for (int i = 0; i < kBuckets; i++) {
+        buckets_[i] = 0;
+    }
+}
+
+LoopStats::Snapshot LoopStats::snapshot() const {
+    Snapshot s;
+    s.iterations = iterations.load(std::memory_order_relaxed);
+    s.pollUpdates = pollUpdates.load(std::memory_order_relaxed);
+    s.readsDeferred = readsDeferred.load(std::memory_order_relaxed);
+    s.writes = writes.load(std::memory_order_relaxed);
+    s.mailboxMsgs = mailboxMsgs.load(std::memory_order_relaxed);
+    s.mailboxFull = mailboxFull.load(std::memory_order_relaxed);
+    s.queued = s.connections = 0;
+    s.bytesRead = bytesRead.load(std::memory_order_relaxed);
+    s.bytesWritten = bytesWritten.load(std::memory_order_relaxed);
+    s.pollWait = pollWait.snapshot();
+    s.events = events.snapshot();
+    s.busy = busy.snapshot();
+    s.timerLag = timerLag.snapshot();
+    s.taskBatch = taskBatch.snapshot();
+    s.taskWait = taskWait.snapshot();
+    return s;
+}
+
+static std::string summary(const char *name, const Histogram::Snapshot &h) {
+    return util::format(" %s avg %.1f p50 %ld p99 %ld max %lu;", name, h.avg(), (long) h.percentile(0.5), (long) h.percentile(0.99),
+                        (unsigned long) h.max);
+}
+
+std::string LoopStats::Snapshot::toString() const {
+    std::string r = util::format("iterations %lu poll updates %lu reads deferred %lu writes %lu mailbox %lu full %lu queued %lu connections %lu read %lu written %lu;",
+                                 (unsigned long) iterations, (unsigned long) pollUpdates, (unsigned long) readsDeferred, (unsigned long) writes,
+                                 (unsigned long) mailboxMsgs, (unsigned long) mailboxFull,
+                                 (unsigned long) queued, (unsigned long) connections, (unsigned long) bytesRead,
+                                 (unsigned long) bytesWritten);
+    r += summary("wait(us)", pollWait);
+    r += summary("events", events);
+    r += summary("busy(us)", busy);
+    r += summary("timer lag(us)", timerLag);
+    r += summary("tasks", taskBatch);
+    r += summary("task wait(us)", taskWait);
+    return r;
+}
+
+}  // namespace titan
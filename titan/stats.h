@@ -0,0 +1,79 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include "util.h"
+
+namespace titan {
+
+// 单线程写入的计数器不需要原子的读-改-写, 其他线程读取时使用relaxed
+inline void statAdd(std::atomic<uint64_t> &a, uint64_t v) {
+    a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+/* 以2的幂为边界的直方图, 第0个桶记录0, 第i个桶记录[2^(i-1), 2^i)的值.
+   只能由一个线程(IO线程)写入, 任意线程可以通过snapshot()读取, 读到的各个字段之间可能有微小的不一致
+*/
+struct Histogram : private noncopyable {
+    static const int kBuckets = 40;
+    struct Snapshot {
+        uint64_t count, sum, max;
+        uint64_t buckets[kBuckets];
+        // p为0到1之间的分位, 返回所在桶的上界
+        int64_t percentile(double p) const;
+        double avg() const { return count ? double(sum) / count : 0; }
+    };
+    Histogram() { clear(); }
+    void add(int64_t v) {
+        if (v < 0) {
+            v = 0;
+        }
+        int i = v ? 64 - __builtin_clzll(v) : 0;
+        statAdd(buckets_[i < kBuckets ? i : kBuckets - 1], 1);
+        statAdd(count_, 1);
+        statAdd(sum_, v);
+        if (uint64_t(v) > max_.load(std::memory_order_relaxed)) {
+            max_.store(v, std::memory_order_relaxed);
+        }
+    }
+    Snapshot snapshot() const;
+    void clear();
+
+   private:
+    std::atomic<uint64_t> count_, sum_, max_;
+    std::atomic<uint64_t> buckets_[kBuckets];
+};
+
+// EventLoop的运行统计, 时间单位均为微秒
+struct LoopStats : private noncopyable {
+    struct Snapshot {
+        uint64_t iterations;
+        uint64_t pollUpdates;
+        uint64_t readsDeferred;
+        uint64_t writes;
+        uint64_t mailboxMsgs, mailboxFull;
+        uint64_t queued; // 读取时tasks_中等待执行的任务数
+        uint64_t connections; // 读取时的连接数
+        uint64_t bytesRead, bytesWritten;
+        Histogram::Snapshot pollWait, events, busy, timerLag, taskBatch, taskWait;
+        std::string toString() const;
+    };
+    LoopStats() : iterations(0), pollUpdates(0), readsDeferred(0), writes(0), mailboxMsgs(0), mailboxFull(0), bytesRead(0), bytesWritten(0) {}
+    Snapshot snapshot() const;
+
+    std::atomic<uint64_t> iterations; // 循环次数
+    std::atomic<uint64_t> pollUpdates; // 修改channel关注事件的次数, 即epoll_ctl(MOD)的次数
+    std::atomic<uint64_t> readsDeferred; // 连接用完读预算, 推迟到下次循环继续读的次数
+    std::atomic<uint64_t> writes; // 连接调用write/writev的次数
+    std::atomic<uint64_t> mailboxMsgs; // 从其他分片的信箱中收到并执行的消息数, 见EventLoop::post
+    std::atomic<uint64_t> mailboxFull; // post时目标信箱已满的次数
+    std::atomic<uint64_t> bytesRead, bytesWritten; // 连接读写的字节数
+    Histogram pollWait; // 阻塞在epoll_wait中的时间
+    Histogram events; // 每次唤醒返回的事件数
+    Histogram busy; // 每次循环执行回调(IO事件, 定时器, 任务)的总时间
+    Histogram timerLag; // 定时器实际执行的时刻与预定时刻(TimerId.first)之差
+    Histogram taskBatch; // 每次执行的任务数, 即执行时tasks_的长度
+    Histogram taskWait; // 任务从safeCall到开始执行的时间
+};
+
+}  // namespace titan
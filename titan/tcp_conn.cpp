@@ -9,7 +9,8 @@ using namespace std;
 namespace titan {
 
 TcpConn::TcpConn()
-    : loop_(NULL), channel_(NULL), state_(State::Invalid), isClient_(false), connectTimeout_(0), reconnectInterval_(-1), connectedTime_(util::timeMilli()) {}
+    : loop_(NULL), channel_(NULL), state_(State::Invalid), isClient_(false), edgeTriggered_(false), readDeferred_(false), corked_(false), flushQueued_(false), closeWhenFlushed_(false), migrating_(false), completionIO_(true), completion_(false), readBudget_(0), roundBytes_(0), msgBudget_(0),
+      roundMsgs_(0), budgetRound_(0), connectTimeout_(0), reconnectInterval_(-1), connectedTime_(util::steadyMilli()), bytes_(0) {}
 
 TcpConn::~TcpConn() {
     trace("tcp destroyed %s - %s", local_.toString().c_str(), peer_.toString().c_str());
@@ -25,7 +26,7 @@ void TcpConn::addIdleCB(int idle, const TcpCallback &cb) {
 void TcpConn::reconnect() {
     auto con = shared_from_this();
     getLoop()->reconnectConns_.insert(con);
-    long long interval = reconnectInterval_ - (util::timeMilli() - connectedTime_);
+    long long interval = reconnectInterval_ - (getLoop()->now() - connectedTime_);
     interval = interval > 0 ? interval : 0;
     info("reconnect interval: %d will reconnect after %lld ms", reconnectInterval_, interval);
     getLoop()->runAfter(interval, [this, con]() {
@@ -44,11 +45,18 @@ void TcpConn::attach(EventLoop *loop, int fd, Ip4Addr local, Ip4Addr peer) {
     local_ = local;
     peer_ = peer;
     delete channel_;
-    channel_ = new Channel(loop, fd, kWriteEvent | kReadEvent);
+    channel_ = new Channel(loop, fd, kWriteEvent | kReadEvent | (edgeTriggered_ ? (int) EPOLLET : 0));
+    completion_ = false; // 连接建立之后再决定
+    sending_.clear(); // 重连之前关闭时取消的发送
+    loop->conns_++; // 在cleanup中减少
+    loop->liveConns_.insert(this);
     trace("tcp constructed %s - %s fd %d", local_.toString().c_str(), peer_.toString().c_str(), fd);
-    TcpConnPtr con = shared_from_this();
-    con->channel_->setReadCallback([=] { con->handleRead(con); });
-    con->channel_->setWriteCallback([=] { con->handleWrite(con); });
+    if (!self_) {
+        self_ = shared_from_this();
+    }
+    channel_->setReadCallback([this] { handleRead(self_); });
+    channel_->setWriteCallback([this] { handleWrite(self_); });
+    channel_->setCompletionCallback([this](IoOp op, int res, const char *data) { handleCompletion(self_, op, res, data); });
 }
 
 void TcpConn::connect(EventLoop *loop, const string &host, unsigned short port, int timeout, const string &localip) {
@@ -57,7 +65,7 @@ void TcpConn::connect(EventLoop *loop, const string &host, unsigned short port,
     destPort_ = port;
     isClient_ = true;
     connectTimeout_ = timeout;
-    connectedTime_ = util::timeMilli();
+    connectedTime_ = loop->now();
     localIp_ = localip;
     Ip4Addr addr(host, port);
     int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
@@ -99,16 +107,106 @@ void TcpConn::connect(EventLoop *loop, const string &host, unsigned short port,
 void TcpConn::close() { // thread-safe
     if (channel_) {
         TcpConnPtr con = shared_from_this();
-        getLoop()->safeCall([con] {
-            if (con->channel_)
+        EventLoop *loop = getLoop();
+        loop->safeCall([con, loop] {
+            if (con->getLoop() != loop || con->migrating_) { // 连接已迁移或者还没有加入新的EventLoop, 在新的EventLoop中关闭
+                con->close();
+            } else if (con->channel_) {
+                con->flushBeforeClose();
                 con->channel_->close();
+            }
+        });
+    }
+}
+
+void TcpConn::closeAfterFlush() { // thread-safe
+    if (channel_) {
+        TcpConnPtr con = shared_from_this();
+        EventLoop *loop = getLoop();
+        loop->safeCall([con, loop] {
+            if (con->getLoop() != loop || con->migrating_) {
+                con->closeAfterFlush();
+            } else if (con->channel_) {
+                con->flushBeforeClose();
+                if (con->flushed()) {
+                    con->channel_->close();
+                } else { // 剩余的数据由可写事件发送
+                    con->closeWhenFlushed_ = true;
+                }
+            }
         });
     }
 }
 
+void TcpConn::migrate(EventLoop *to) { // thread-safe
+    TcpConnPtr con = shared_from_this();
+    EventLoop *loop = getLoop();
+    loop->safeCall([con, loop, to] { // 在回调之外执行, handleRead等函数返回后才不再使用channel
+        if (con->getLoop() != loop || con->migrating_) {
+            con->migrate(to);
+        } else {
+            con->doMigrate(to);
+        }
+    });
+}
+
+void TcpConn::doMigrate(EventLoop *to) {
+    EventLoop *from = getLoop();
+    if (to == from || state_ != State::Connected || channel_ == NULL) {
+        return;
+    }
+    std::vector<std::pair<int, TcpCallback>> idles;
+    for (auto &idle : idleIds_) {
+        if (idle->lst_) {
+            idles.emplace_back(idle->lst_->idle_, idle->cb_);
+        }
+        from->unregisterIdle(idle);
+    }
+    idleIds_.clear();
+    from->cancel(timeoutId_); // 连接超时的定时器在Connected之后已经没有作用, 句柄只在from的时间轮中有效, 不能留给cleanup在to上取消
+    timeoutId_ = TimerId();
+    if (flushQueued_) { // 在原EventLoop中发送合并的数据, 之后corked_中的记录不再处理这个连接
+        flush();
+    }
+    migrating_ = true; // detach时poller交回的数据和发送结果只记录, 不调用回调
+    channel_->detach();
+    if (sending_.size()) { // 取消的发送放回output_的前面, 在新的EventLoop中重新发送
+        sending_.append(output_.data(), output_.size());
+        output_.clear();
+        output_.absorb(sending_);
+    }
+    from->conns_--;
+    from->liveConns_.erase(this);
+    to->pendingConns_++;
+    TcpConnPtr con = shared_from_this();
+    // 在投递任务之前修改, 新线程中看到的getLoop()总是to. 在此之后, 任务之前通过getLoop()投递到to的close/migrate检查migrating_后重新投递
+    loop_ = to;
+    to->safeCall([con, to, idles] {
+        to->pendingConns_--;
+        con->channel_->attach(to);
+        to->conns_++;
+        to->liveConns_.insert(con.get());
+        for (auto &idle : idles) {
+            con->idleIds_.push_back(to->registerIdle(idle.first, con, idle.second));
+        }
+        con->migrating_ = false;
+        bool completion = con->completion_;
+        if (!con->startCompletion() && completion) { // 新的poller不支持完成模式, 改回就绪通知
+            con->channel_->enableReadWrite(true, con->output_.size() > 0);
+        }
+        if (con->input_.size()) { // detach时交回的数据
+            con->handleRead(con);
+        }
+        trace("tcp %s - %s migrated", con->local_.toString().c_str(), con->peer_.toString().c_str());
+    });
+}
+
 void TcpConn::cleanup(const TcpConnPtr &con) {
     if (readcb_ && input_.size()) {
+        int budget = msgBudget_; // 连接即将关闭, 剩余的消息全部处理
+        msgBudget_ = 0;
         readcb_(con);
+        msgBudget_ = budget;
     }
 
     if (state_ == State::Handshaking) {
@@ -118,9 +216,13 @@ void TcpConn::cleanup(const TcpConnPtr &con) {
     }
     trace("tcp closing %s - %s fd %d errno %d(%s)", local_.toString().c_str(), peer_.toString().c_str(), channel_ ? channel_->fd() : -1, errno, strerror(errno));
     getLoop()->cancel(timeoutId_);
+    getLoop()->conns_--;
+    getLoop()->liveConns_.erase(this);
     if (statecb_) {
         statecb_(con);
     }
+    flushBeforeClose(); // 对端关闭时fd仍然有效, 发出上面的回调中合并的数据
+    closeWhenFlushed_ = false;
     if (reconnectInterval_ >= 0 && !getLoop()->exited()) {  // reconnect
         reconnect();
         return;
@@ -129,46 +231,136 @@ void TcpConn::cleanup(const TcpConnPtr &con) {
         getLoop()->unregisterIdle(idle);
     }
     readcb_ = writablecb_ = statecb_ = nullptr;
-    // channel may have hold TcpConnPtr, set channel_ to NULL before delete
     Channel *ch = channel_;
     channel_ = NULL;
     delete ch;
+    if (self_) {
+        getLoop()->retired_.push_back(self_); // 调用者可能还在使用con, 在本次循环末尾释放
+    }
 }
 
 void TcpConn::handleRead(const TcpConnPtr &con) {
     if (state_ == State::Handshaking) {
          handleHandshake(con);
     } 
+    if (completion_ && state_ == State::Connected) { // 数据由poller接收, 只处理input_. Channel::close之后fd为-1
+        if (channel_->fd() < 0) {
+            cleanup(con);
+        } else if (msgBudget_ && budgetExhausted()) {
+            deferRead(con);
+        } else if (readcb_ && input_.size()) {
+            readcb_(con);
+        }
+        return;
+    }
+    if ((readBudget_ || msgBudget_) && state_ == State::Connected && budgetExhausted()) {
+        deferRead(con); // 本次循环中已经读过, 比如边沿触发时既有事件又在deferredReads_中
+        return;
+    }
     while (state_ == State::Connected) {
         input_.makeRoom();
+        size_t room = input_.space();
+        if (readBudget_) {
+            room = std::min(room, readBudget_ - roundBytes_);
+        }
         int rd = 0;
         if (channel_->fd() >= 0) {
-            rd = readImp(channel_->fd(), input_.end(), input_.space());
+            rd = readImp(channel_->fd(), input_.end(), room);
             trace("channel %lld fd %d readed %d bytes", (long long) channel_->id(), channel_->fd(), rd);
         }
         if (rd > 0) {
             input_.addSize(rd);
-            continue;
+            statAdd(getLoop()->stats_.bytesRead, rd);
+            bytes_ += rd;
+            roundBytes_ += rd;
+            if (!readBudget_ || roundBytes_ < readBudget_) {
+                continue;
+            }
+            deferRead(con); // 读预算用完, 已读到的数据照常交给readcb_, socket中剩余的数据下次循环再读
         } else if (rd == -1 && errno == EINTR) {
             continue;
-        } else if (rd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        } else if (!(rd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
+            if (channel_->fd() == -1 || rd == 0 || rd == -1) {
+                cleanup(con);
+            } else {
+                error("read error: channel %lld fd %d rd %ld %d %s", (long long) channel_->id(), channel_->fd(), rd, errno, strerror(errno));
+            }
+            break;
+        }
+        for (auto &idle : idleIds_) {
+            getLoop()->updateIdle(idle);
+        }
+        if (readcb_ && input_.size()) { // 读完数据后调用readcb_从input_ Buffer中解码出消息, 执行回调
+            readcb_(con);
+        }
+        break;
+    }
+}
+
+void TcpConn::handleCompletion(const TcpConnPtr &con, IoOp op, int res, const char *data) {
+    if (op == IoSend) {
+        handleSent(con, res);
+    } else if (res > 0) {
+        input_.append(data, res);
+        statAdd(getLoop()->stats_.bytesRead, res);
+        bytes_ += res;
+        if (!migrating_) { // 迁移时交回的数据在新的EventLoop中处理
             for (auto &idle : idleIds_) {
                 getLoop()->updateIdle(idle);
             }
-            if (readcb_ && input_.size()) { // 读完数据后调用readcb_从input_ Buffer中解码出消息, 执行回调
-                readcb_(con);
-            }
-            break;
-        } else if (channel_->fd() == -1 || rd == 0 || rd == -1) {
-            cleanup(con);
-            break;
-        } else {
-            error("read error: channel %lld fd %d rd %ld %d %s", (long long) channel_->id(), channel_->fd(), rd, errno, strerror(errno));
-            break;
+            handleRead(con);
+        }
+    } else if (!migrating_ && state_ == State::Connected) { // 对端关闭或出错
+        trace("channel %lld fd %d recv return %d", (long long) channel_->id(), channel_->fd(), res);
+        cleanup(con);
+    }
+}
+
+void TcpConn::handleSent(const TcpConnPtr &con, int res) {
+    statAdd(getLoop()->stats_.writes, 1);
+    if (res > 0) {
+        sending_.consume(res);
+        statAdd(getLoop()->stats_.bytesWritten, res);
+        bytes_ += res;
+    } else if (res != -ECANCELED) { // 取消只发生在迁移和关闭时, 数据保留
+        error("send error: channel %lld fd %d %d %s", (long long) channel_->id(), channel_->fd(), -res, strerror(-res));
+        sending_.clear();
+    }
+    if (migrating_ || state_ != State::Connected) {
+        return;
+    }
+    if (sending_.size()) { // 只发送了一部分
+        getLoop()->poller_->startSend(channel_, sending_.begin(), sending_.size());
+    } else if (output_.size()) { // 发送期间追加的数据
+        flush();
+    } else {
+        if (writablecb_) {
+            writablecb_(con);
+        }
+        if (closeWhenFlushed_ && flushed()) {
+            channel_->close();
         }
     }
 }
 
+bool TcpConn::budgetExhausted() {
+    uint64_t round = getLoop()->iteration();
+    if (round != budgetRound_) {
+        budgetRound_ = round;
+        roundBytes_ = 0;
+        roundMsgs_ = 0;
+    }
+    return (readBudget_ && roundBytes_ >= readBudget_) || (msgBudget_ && roundMsgs_ >= msgBudget_);
+}
+
+void TcpConn::deferRead(const TcpConnPtr &con) {
+    if (!readDeferred_) {
+        readDeferred_ = true;
+        getLoop()->deferredReads_.push_back(con);
+        statAdd(getLoop()->stats_.readsDeferred, 1);
+    }
+}
+
 void TcpConn::handleWrite(const TcpConnPtr &con) {
     if (state_ == State::Handshaking) {
         handleHandshake(con);
@@ -178,7 +370,9 @@ void TcpConn::handleWrite(const TcpConnPtr &con) {
         if (output_.empty() && writablecb_) {
             writablecb_(con);
         }
-        if (output_.empty() && channel_->writeEnabled()) {  // writablecb_ may write something
+        if (output_.empty() && closeWhenFlushed_) { // closeAfterFlush的数据已全部发出
+            channel_->close();
+        } else if (output_.empty() && channel_->writeEnabled()) {  // writablecb_ may write something
             channel_->enableWrite(false); // 一旦发送完毕数据(output_ Buffer中的数据), 立刻停止writable事件, 避免busy loop
         }
     } else {
@@ -207,8 +401,10 @@ int TcpConn::handleHandshake(const TcpConnPtr &con) {
             return -1;
         }
         state_ = State::Connected;
-        channel_->enableReadWrite(true, false); // this connection is connected successfully! No need to care for KWriteEvent.
-        connectedTime_ = util::timeMilli();
+        if (!startCompletion()) {
+            channel_->enableReadWrite(true, false); // this connection is connected successfully! No need to care for KWriteEvent.
+        }
+        connectedTime_ = getLoop()->now();
         trace("tcp connected %s - %s fd %d", local_.toString().c_str(), peer_.toString().c_str(), channel_->fd());
         if (statecb_) {
             statecb_(con);
@@ -226,8 +422,11 @@ ssize_t TcpConn::isend(const char *buf, size_t len) {
     while (sended < len) {
         ssize_t wd = writeImp(channel_->fd(), buf + sended, len - sended);
         trace("channel %lld fd %d write %ld bytes", (long long) channel_->id(), channel_->fd(), wd);
+        statAdd(getLoop()->stats_.writes, 1);
         if (wd > 0) {
             sended += wd;
+            statAdd(getLoop()->stats_.bytesWritten, wd);
+            bytes_ += wd;
             continue;
         } else if (wd == -1 && errno == EINTR) {
             continue;
@@ -244,8 +443,102 @@ ssize_t TcpConn::isend(const char *buf, size_t len) {
     return sended;
 }
 
+size_t TcpConn::isendv(const char *buf, size_t len) {
+    size_t sended = 0;
+    while (output_.size() || sended < len) {
+        struct iovec iov[2];
+        int cnt = 0;
+        if (output_.size()) {
+            iov[cnt].iov_base = output_.begin();
+            iov[cnt++].iov_len = output_.size();
+        }
+        if (sended < len) {
+            iov[cnt].iov_base = (void *) (buf + sended);
+            iov[cnt++].iov_len = len - sended;
+        }
+        ssize_t wd = writevImp(channel_->fd(), iov, cnt);
+        trace("channel %lld fd %d writev %ld bytes", (long long) channel_->id(), channel_->fd(), wd);
+        statAdd(getLoop()->stats_.writes, 1);
+        if (wd > 0) {
+            size_t head = std::min((size_t) wd, output_.size());
+            output_.consume(head);
+            sended += wd - head;
+            statAdd(getLoop()->stats_.bytesWritten, wd);
+            bytes_ += wd;
+        } else if (wd == -1 && errno == EINTR) {
+            continue;
+        } else if (wd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!channel_->writeEnabled()) {
+                channel_->enableWrite(true);
+            }
+            break;
+        } else {
+            error("writev error: channel %lld fd %d wd %ld %d %s", (long long) channel_->id(), channel_->fd(), wd, errno, strerror(errno));
+            break;
+        }
+    }
+    return sended;
+}
+
+void TcpConn::queueFlush() {
+    if (output_.size() >= kCorkLimit) { // 积累的数据足够多, 不再等待
+        flush();
+    } else if (!flushQueued_) {
+        flushQueued_ = true;
+        getLoop()->corked_.push_back(self_);
+    }
+}
+
+bool TcpConn::startCompletion() {
+    PollerBase *poller = getLoop()->poller_;
+    completion_ = completionIO_ && poller->completionIO();
+    if (completion_) {
+        poller->startRecv(channel_);
+        if (output_.size()) { // 握手期间或者迁移之前积累的数据
+            queueFlush();
+        }
+    }
+    return completion_;
+}
+
+void TcpConn::flush(bool notify) {
+    flushQueued_ = false;
+    if (completion_) { // 上一次发送完成之前数据留在output_中, 由handleSent继续发送
+        if (channel_ && channel_->fd() >= 0 && sending_.empty() && output_.size()) {
+            sending_.absorb(output_);
+            getLoop()->poller_->startSend(channel_, sending_.begin(), sending_.size());
+        }
+        return;
+    }
+    if (channel_ && channel_->fd() >= 0 && output_.size() && !channel_->writeEnabled()) { // 可写事件已注册时由handleWrite发送
+        output_.consume(isend(output_.begin(), output_.size()));
+        if (notify && output_.empty() && writablecb_) { // 与handleWrite相同, 可写事件没有注册, 比如co::drain等待的协程只能在这里恢复
+            writablecb_(self_);
+        }
+    }
+}
+
+void TcpConn::flushBeforeClose() {
+    if (!flushQueued_) {
+        return;
+    }
+    flush();
+    std::vector<TcpConnPtr> &corked = getLoop()->corked_;
+    corked.erase(std::remove(corked.begin(), corked.end(), self_), corked.end());
+}
+
 void TcpConn::send(Buffer &buf) {
-    if (channel_) {
+    if (channel_ && completion_) {
+        output_.absorb(buf);
+        if (sending_.empty()) {
+            queueFlush();
+        }
+    } else if (channel_ && corked_) {
+        output_.absorb(buf); // output_为空时只交换Buffer, 不复制
+        if (!channel_->writeEnabled()) {
+            queueFlush();
+        }
+    } else if (channel_) {
         if (channel_->writeEnabled()) {  // just full
             output_.absorb(buf);
         }
@@ -265,7 +558,22 @@ void TcpConn::send(Buffer &buf) {
 }
 
 void TcpConn::send(const char *buf, size_t len) {
-    if (channel_) {
+    if (channel_ && completion_) {
+        output_.append(buf, len);
+        if (sending_.empty()) {
+            queueFlush();
+        }
+    } else if (channel_ && corked_) {
+        if (channel_->writeEnabled() || output_.size() + len < kCorkLimit) {
+            output_.append(buf, len);
+            if (!channel_->writeEnabled()) {
+                queueFlush();
+            }
+        } else { // 数据较多, 与output_中已有的数据一起用writev立即发送, 不复制buf
+            size_t sended = isendv(buf, len);
+            output_.append(buf + sended, len - sended);
+        }
+    } else if (channel_) {
         // 为了保证数据的有效性, 如果output_ Buffer中仍有(上次的)数据未发送, 则不能使用isend直接发送数据, 而应append到output_中.
         if (output_.empty()) {
             ssize_t sended = isend(buf, len);
@@ -283,9 +591,17 @@ void TcpConn::send(const char *buf, size_t len) {
 void TcpConn::setMsgCallback(CodecBase *codec, const MsgCallback &cb) {
     assert(!readcb_);
     codec_.reset(codec);
-    setReadCallback([cb](const TcpConnPtr &con) {
+    setReadCallback(msgReadCallback(cb));
+}
+
+TcpCallback TcpConn::msgReadCallback(const MsgCallback &cb) {
+    return [cb](const TcpConnPtr &con) {
         int r = 1;
         while (r) {
+            if (con->msgBudget_ && con->roundMsgs_ >= con->msgBudget_) { // 剩余的消息下次循环再处理
+                con->deferRead(con);
+                break;
+            }
             Slice msg;
             r = con->codec_->tryDecode(con->getInput(), msg);
             if (r < 0) {
@@ -293,11 +609,12 @@ void TcpConn::setMsgCallback(CodecBase *codec, const MsgCallback &cb) {
                 break;
             } else if (r > 0) {
                 trace("a msg decoded. origin len %d msg len %ld", r, msg.size());
+                con->roundMsgs_++;
                 cb(con, msg);
                 con->getInput().consume(r);
             }
         }
-    });
+    };
 }
 
 void TcpConn::sendMsg(Slice msg) {
@@ -1,4 +1,5 @@
 #pragma once
+#include <sys/uio.h>
 #include "event_loop.h"
 #include "channel.h"
 
@@ -58,14 +59,16 @@ struct TcpConn : public std::enable_shared_from_this<TcpConn>, private noncopyab
         return ctx_.context<T>();
     }
 
-    EventLoop *getLoop() { return loop_; }
+    EventLoop *getLoop() { return loop_.load(std::memory_order_acquire); }
     State getState() { return state_; }
     // TcpConn的输入输出缓冲区
     Buffer &getInput() { return input_; }
     Buffer &getOutput() { return output_; }                   
 
     Channel *getChannel() { return channel_; }
-    bool writable() { return channel_ ? channel_->writeEnabled() : false; }
+    bool writable() { return channel_ ? (completion_ ? !sending_.empty() : channel_->writeEnabled()) : false; }
+    // 数据已全部交给内核: output_为空, 并且没有正在进行的发送(完成模式)
+    bool flushed() { return output_.empty() && sending_.empty(); }
 
     //发送数据
     void sendOutput() { send(output_); }
@@ -94,20 +97,54 @@ struct TcpConn : public std::enable_shared_from_this<TcpConn>, private noncopyab
 
     // conn会在下个事件周期进行处理
     void close();
+    // 与close相同, 但output_中还有数据(比如写到EAGAIN)时等待发送完毕再关闭. 对端一直不读取时连接不会关闭
+    void closeAfterFlush();
+    /* 把连接迁移到另一个EventLoop, 在当前EventLoop本次循环的末尾执行. 可在任意线程调用, 只迁移Connected状态的连接.
+       channel和缓冲区中的数据一起转移, 空闲回调在新的EventLoop中重新注册(空闲时间重新计算), 连接超时的定时器被取消.
+       调用之后只能在getLoop()返回的EventLoop中使用连接, 调用者在原EventLoop上添加的定时器等需要由调用者自己处理.
+       getLoop()在迁移开始时就返回新的EventLoop, 此时其他线程投递给它的任务可能先于连接的加入执行
+    */
+    void migrate(EventLoop *to);
+    /* 使用边沿触发, 需要在连接建立(connect/attach)之前调用. 可写事件始终注册, 输出缓冲区从空到非空及发送完毕时
+       不再调用epoll_ctl, 握手完成时也不需要修改关注的事件. 重连时保持
+    */
+    void setEdgeTriggered(bool edge) { edgeTriggered_ = edge; }
+    /* 每次事件循环中读取的字节数和处理的消息数(setMsgCallback)的上限, 0表示不限制. 用完后已读到的数据照常交给回调,
+       剩余的数据在下次循环中与其他连接的事件一起处理, 避免一个高速发送的连接独占EventLoop, 同时限制了input_的增长.
+       边沿触发和io_uring下不会再次产生事件, 由EventLoop记录并继续读取. 只设置消息预算时每次仍读到EAGAIN, input_可能持续增长, 应同时设置字节预算.
+       完成模式(setCompletionIO)下数据由内核持续接收, 字节预算不起作用
+    */
+    void setReadBudget(size_t bytes, int msgs = 0) {
+        readBudget_ = bytes;
+        msgBudget_ = msgs;
+    }
+    /* 合并发送: 回调中的send/sendMsg只把数据追加到output_, 由EventLoop在本次循环的末尾对每个有数据的连接调用一次write,
+       一次回调或者一次循环中向同一连接发送多条消息时减少系统调用. output_积累超过kCorkLimit时立即发送,
+       较大的数据与output_一起用writev发送, 不复制到output_. 需要在连接所属EventLoop的线程中调用send
+    */
+    void setCorked(bool corked) { corked_ = corked; }
+    static const size_t kCorkLimit = 64 * 1024;
+    /* 所属EventLoop的poller支持基于完成的IO(见UringPoller)时, 连接建立之后由poller接收和发送, 默认开启.
+       接收的数据从provided buffer复制到input_, 发送时output_整体交给poller, 完成之前的send追加到output_, 一次循环中的send合并发送.
+       此时不调用readImp/writeImp, 重载了它们的子类需要在连接建立之前关闭
+    */
+    void setCompletionIO(bool enable) { completionIO_ = enable; }
     //设置重连时间间隔，-1: 不重连，0:立即重连，其它：等待毫秒数，未设置不重连
     void setReconnectInterval(int milli) { reconnectInterval_ = milli; }
 
-    //!慎用. 立即关闭连接，清理相关资源，可能导致该连接的引用计数变为0，从而使当前调用者引用的连接被析构
+    //!慎用. 立即关闭连接，清理相关资源. 连接对象在本次事件循环的末尾才会释放, 当前回调中的引用仍然有效
     void closeNow() {
-        if (channel_)
+        if (channel_) {
+            flushBeforeClose();
             channel_->close();
+        }
     }
 
     //远程地址的字符串
     std::string peerAddrStr() { return peer_.toString(); }
 
    public:
-    EventLoop *loop_;
+    std::atomic<EventLoop *> loop_; // 迁移时在原EventLoop的线程中修改, close等线程安全的函数在其他线程读取
     Channel *channel_; // 管理本连接的cfd
     Buffer input_, output_; // 应用层输入输出缓冲区
     Ip4Addr local_, peer_;
@@ -120,18 +157,48 @@ struct TcpConn : public std::enable_shared_from_this<TcpConn>, private noncopyab
     std::string destHost_;
     unsigned short destPort_;
     bool isClient_;
+    bool edgeTriggered_;
+    bool readDeferred_; // 已加入EventLoop::deferredReads_
+    bool corked_;
+    bool flushQueued_; // 已加入EventLoop::corked_
+    bool closeWhenFlushed_; // closeAfterFlush: output_发送完毕后在handleWrite中关闭
+    bool migrating_; // loop_已指向新的EventLoop, 但还没有加入它的poller
+    bool completionIO_, completion_; // 允许/正在使用基于完成的IO
+    Buffer sending_; // 完成模式下已交给poller, 还没有发送完成的数据. 不为空时poller中有一个发送请求
+    size_t readBudget_, roundBytes_; // 读预算以及本次循环已读取的字节数
+    int msgBudget_, roundMsgs_;
+    uint64_t budgetRound_; // roundBytes_和roundMsgs_所属的循环
     int connectTimeout_, reconnectInterval_;
-    int64_t connectedTime_;
+    int64_t connectedTime_; // 以EventLoop::now()为基准的毫秒时间戳
+    uint64_t bytes_; // 读写的字节数, 由再平衡定期清零
     std::unique_ptr<CodecBase> codec_;
+    /* 连接加入EventLoop之后由自己持有, 关闭时在本次循环的末尾释放. Channel回调把self_以const TcpConnPtr &传给
+       handleRead/handleWrite和用户回调, 只在IO线程中使用, 派发事件时不需要复制shared_ptr(原子操作);
+       回调中即使关闭了连接, 引用在回调返回之前仍然有效. 其他线程使用连接时仍需持有TcpConnPtr
+    */
+    TcpConnPtr self_;
     void handleRead(const TcpConnPtr &con);
+    bool budgetExhausted();
+    void deferRead(const TcpConnPtr &con); // 下次循环继续读取
     void handleWrite(const TcpConnPtr &con);
+    void handleCompletion(const TcpConnPtr &con, IoOp op, int res, const char *data);
+    void handleSent(const TcpConnPtr &con, int res);
+    bool startCompletion(); // 连接建立或迁移之后, poller支持时改用完成模式, 返回是否使用
     ssize_t isend(const char *buf, size_t len);
+    size_t isendv(const char *buf, size_t len); // 用writev发送output_和buf, 返回buf中已发送的字节数
+    void queueFlush(); // 在本次循环末尾发送output_
+    void flush(bool notify = false); // notify: 发送完毕时调用writablecb_, 只在EventLoop::flushCorked中使用, 避免在send中重入回调
+    void flushBeforeClose(); // 关闭fd之前发送合并的数据, 并从EventLoop::corked_中移除
+    static TcpCallback msgReadCallback(const MsgCallback &cb); // 用codec_解码并遵守消息预算的读回调, TcpServer::setTcpConnMsgCallback也使用
     void cleanup(const TcpConnPtr &con);
     void attach(EventLoop *loop, int fd, Ip4Addr local, Ip4Addr peer);
     void connect(EventLoop *loop, const std::string &host, unsigned short port, int timeout, const std::string &localip);
     void reconnect();
+    void doMigrate(EventLoop *to);
     virtual int readImp(int fd, void *buf, size_t bytes) { return ::read(fd, buf, bytes); }
     virtual int writeImp(int fd, const void *buf, size_t bytes) { return ::write(fd, buf, bytes); }
+    // 重载了writeImp的子类(比如加密连接)需要同时重载writevImp
+    virtual int writevImp(int fd, const struct iovec *iov, int cnt) { return ::writev(fd, iov, cnt); }
     virtual int handleHandshake(const TcpConnPtr &con);
 };
 
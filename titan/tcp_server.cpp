@@ -9,10 +9,36 @@
 namespace titan {
 
 TcpServer::TcpServer(EventLoopBases *bases) 
-        : loop_(bases->allocEventLoop()), bases_(bases), listen_channel_(NULL), createcb_([] { return TcpConnPtr(new TcpConn); }) {}
+        : loop_(bases->allocEventLoop()), bases_(bases), sharded_(false), sharedSocket_(false), stopped_(false), edgeTriggered_(false), corked_(false), readBudget_(0), msgBudget_(0), createcb_([] { return TcpConnPtr(new TcpConn); }) {}
 
-int TcpServer::bind(const std::string &host, unsigned short port, bool reusePort) {
-    addr_ = Ip4Addr(host, port);
+TcpServer::~TcpServer() {
+    closeListeners();
+}
+
+void TcpServer::closeListeners() {
+    for (Channel *ch : listen_channels_) {
+        delete ch;
+    }
+    listen_channels_.clear();
+}
+
+void TcpServer::addListener(EventLoop *loop, int fd, int events) {
+    Channel *ch = new Channel(loop, fd, events);
+    ch->setReadCallback([this, ch] { handleAccept(ch); });
+    if (loop->poller_->completionIO()) { // multishot accept, 新连接的fd由完成事件交回
+        ch->setCompletionCallback([this, ch](IoOp op, int res, const char *data) {
+            if (res >= 0) {
+                acceptConn(ch, res);
+            } else {
+                warn("accept return %d(%s)", -res, strerror(-res));
+            }
+        });
+        loop->poller_->startAccept(ch);
+    }
+    listen_channels_.push_back(ch);
+}
+
+int TcpServer::listenFd(bool reusePort) {
     int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     int r = net::setReuseAddr(fd); // net::setReuseAddr(fd, true)
     fatalif(r, "set socket reuse option failed");
@@ -20,15 +46,147 @@ int TcpServer::bind(const std::string &host, unsigned short port, bool reusePort
     fatalif(r, "set socket reuse port option failed");
     r = ::bind(fd, (struct sockaddr *) &addr_.getAddr(), sizeof(struct sockaddr));
     if (r) {
+        int err = errno;
         close(fd);
-        error("bind to %s failed %d %s", addr_.toString().c_str(), errno, strerror(errno));
-        return errno;
+        error("bind to %s failed %d %s", addr_.toString().c_str(), err, strerror(err));
+        errno = err;
+        return -1;
     }
-    r = listen(fd, 20);
+    r = listen(fd, SOMAXCONN);
     fatalif(r, "listen failed %d %s", errno, strerror(errno));
+    return fd;
+}
+
+int TcpServer::bind(const std::string &host, unsigned short port, bool reusePort) {
+    addr_ = Ip4Addr(host, port);
+    int fd = listenFd(reusePort);
+    if (fd < 0) {
+        return errno;
+    }
     info("fd %d listening at %s", fd, addr_.toString().c_str());
-    listen_channel_ = new Channel(loop_, fd, kReadEvent);
-    listen_channel_->setReadCallback([this] { handleAccept(); });
+    addListener(loop_, fd, kReadEvent);
+    return 0;
+}
+
+int TcpServer::checkListening(int fd, Ip4Addr *addr) {
+    struct sockaddr_in local;
+    socklen_t len = sizeof local;
+    int accepting = 0;
+    socklen_t alen = sizeof accepting;
+    if (getsockname(fd, (struct sockaddr *) &local, &len) || getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &alen)) {
+        return errno;
+    }
+    if (!accepting) {
+        return EINVAL;
+    }
+    int r = util::addFdFlag(fd, FD_CLOEXEC);
+    fatalif(r, "addFdFlag FD_CLOEXEC failed");
+    *addr = Ip4Addr(local);
+    return 0;
+}
+
+int TcpServer::adopt(int fd, ListenMode mode) {
+    int r = mode == ReusePort ? EINVAL : checkListening(fd, &addr_);
+    if (r) {
+        return r;
+    }
+    if (mode == Single) {
+        info("fd %d adopted, listening at %s", fd, addr_.toString().c_str());
+        addListener(loop_, fd, kReadEvent);
+        return 0;
+    }
+    std::vector<int> fds{fd};
+    while ((int) fds.size() < bases_->loopCount()) { // 每个Channel持有自己的fd, 指向同一个socket
+        int dfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (dfd < 0) {
+            int err = errno;
+            error("dup listen fd failed %d %s", err, strerror(err));
+            for (size_t i = 1; i < fds.size(); i++) {
+                close(fds[i]);
+            }
+            return err;
+        }
+        fds.push_back(dfd);
+    }
+    for (size_t i = 0; i < fds.size(); i++) {
+        info("fd %d adopted, listening at %s exclusive", fds[i], addr_.toString().c_str());
+        addListener(bases_->loopAt(i), fds[i], kReadEvent | EPOLLEXCLUSIVE);
+    }
+    sharded_ = true;
+    sharedSocket_ = true;
+    return 0;
+}
+
+int TcpServer::adopt(const std::vector<int> &fds, ListenMode mode) {
+    if (fds.empty()) {
+        return EINVAL;
+    }
+    if (fds.size() == 1) {
+        return adopt(fds[0], mode);
+    }
+    for (int fd : fds) {
+        int r = checkListening(fd, &addr_);
+        if (r) {
+            return r;
+        }
+    }
+    for (size_t i = 0; i < fds.size(); i++) {
+        EventLoop *loop = bases_->loopAt(i % bases_->loopCount());
+        info("fd %d adopted, listening at %s reuseport", fds[i], addr_.toString().c_str());
+        addListener(loop, fds[i], kReadEvent);
+    }
+    sharded_ = true;
+    return 0;
+}
+
+std::vector<int> TcpServer::listenFds() {
+    std::vector<int> fds;
+    for (Channel *ch : listen_channels_) {
+        fds.push_back(ch->fd());
+        if (sharedSocket_) {
+            break;
+        }
+    }
+    return fds;
+}
+
+void TcpServer::stopAccept() {
+    stopped_ = true;
+    for (Channel *ch : listen_channels_) {
+        ch->getLoop()->safeCall([ch] { delete ch; }); // channel只能在所属的IO线程中移除
+    }
+    listen_channels_.clear();
+}
+
+int TcpServer::bind(const std::string &host, unsigned short port, ListenMode mode) {
+    if (mode == Single) {
+        return bind(host, port, false);
+    }
+    addr_ = Ip4Addr(host, port);
+    int shared = -1;
+    for (int i = 0; i < bases_->loopCount(); i++) {
+        EventLoop *loop = bases_->loopAt(i);
+        int fd;
+        if (mode == ReusePort) {
+            fd = listenFd(true);
+        } else if (shared < 0) {
+            fd = shared = listenFd(false);
+        } else { // 每个Channel持有自己的fd, 指向同一个socket
+            fd = fcntl(shared, F_DUPFD_CLOEXEC, 0);
+            if (fd < 0) {
+                error("dup listen fd failed %d %s", errno, strerror(errno));
+            }
+        }
+        if (fd < 0) {
+            int err = errno;
+            closeListeners();
+            return err;
+        }
+        info("fd %d listening at %s %s", fd, addr_.toString().c_str(), mode == ReusePort ? "reuseport" : "exclusive");
+        addListener(loop, fd, mode == Exclusive ? kReadEvent | EPOLLEXCLUSIVE : kReadEvent);
+    }
+    sharded_ = true;
+    sharedSocket_ = mode == Exclusive;
     return 0;
 }
 
@@ -41,66 +199,77 @@ TcpServerPtr TcpServer::startServer(EventLoopBases *bases, const std::string &ho
     return r == 0 ? p : NULL;
 }
 
+TcpServerPtr TcpServer::startServer(EventLoopBases *bases, const std::string &host, unsigned short port, ListenMode mode) {
+    TcpServerPtr p(new TcpServer(bases));
+    int r = p->bind(host, port, mode);
+    if (r) {
+        error("bind to %s:%d failed %d(%s)", host.c_str(), port, r, strerror(r));
+    }
+    return r == 0 ? p : NULL;
+}
+
 void TcpServer::setTcpConnMsgCallback(CodecBase *codec, const MsgCallback &cb) {
     assert(!readcb_);
     codec_.reset(codec);
-    setTcpConnReadCallback([cb](const TcpConnPtr &con) {
-        int r = 1;
-        while (r) {
-            Slice msg;
-            r = con->codec_->tryDecode(con->getInput(), msg);
-            if (r < 0) {
-                con->channel_->close();
-                break;
-            } else if (r > 0) {
-                trace("a msg decoded. origin len %d msg len %ld", r, msg.size());
-                cb(con, msg);
-                con->getInput().consume(r);
-            }
-        }
-    });
+    setTcpConnReadCallback(TcpConn::msgReadCallback(cb)); // 与TcpConn::setMsgCallback相同, 包括消息预算
 }
 
-void TcpServer::handleAccept() {
+void TcpServer::handleAccept(Channel *ch) {
     struct sockaddr_in raddr;
     socklen_t rsz = sizeof(raddr);
-    int lfd = listen_channel_->fd();
+    int lfd = ch->fd();
     int cfd;
     // when non-block accept returns cfd > 0 and poll() returns cfd is writable: connection is establised
     while (lfd >= 0 && (cfd = accept(lfd, (struct sockaddr *) &raddr, &rsz)) >= 0) { // accept策略: 读一个, 读N个, 读完
-        sockaddr_in local, peer;
-        socklen_t alen = sizeof(peer);
-        int r = getpeername(cfd, (sockaddr *) &peer, &alen);
-        if (r < 0) {
-            error("get peer name failed %d %s", errno, strerror(errno));
-            continue;
-        }
-        r = getsockname(cfd, (sockaddr *) &local, &alen);
-        if (r < 0) {
-            error("getsockname failed %d %s", errno, strerror(errno));
-            continue;
-        }
-        r = util::addFdFlag(cfd, FD_CLOEXEC);
+        int r = util::addFdFlag(cfd, FD_CLOEXEC);
         fatalif(r, "addFdFlag FD_CLOEXEC failed");
-        /* 为cfd连接分配的EventLoop有2种策略: 
-            a). 程序只用了一个EventLoop, 在这一个线程的一个EventLoop上同时处理accept新连接和旧连接数据的read/write
-            b). MultiEventLoops. 一个主IO线程的EventLoop用来处理新连接, 并且为每个新连接分配一个EventLoop, 
-             并在一个新的线程上运行这个EventLoop, 这个Eventloop可能管理多个连接 数据读写
-        */
-        EventLoop *newLoop = bases_->allocEventLoop(); 
-        if (newLoop == loop_) {
-            addNewConn(newLoop, cfd, local, peer);
-        } else {
-            newLoop->safeCall(std::bind(&TcpServer::addNewConn, this, newLoop, cfd, local, peer)); // 在新连接自己的EventLoop上执行addcon任务
-        }
+        acceptConn(ch, cfd);
     }
     if (lfd >= 0 && errno != EAGAIN && errno != EINTR) {
         warn("accept return %d  %d(%s)", cfd, errno, strerror(errno));
     }
 }
 
+void TcpServer::acceptConn(Channel *ch, int cfd) {
+    sockaddr_in local, peer;
+    socklen_t alen = sizeof(peer);
+    int r = getpeername(cfd, (sockaddr *) &peer, &alen);
+    if (r < 0) {
+        error("get peer name failed %d %s", errno, strerror(errno));
+        close(cfd);
+        return;
+    }
+    r = getsockname(cfd, (sockaddr *) &local, &alen);
+    if (r < 0) {
+        error("getsockname failed %d %s", errno, strerror(errno));
+        close(cfd);
+        return;
+    }
+    /* 为cfd连接分配的EventLoop有2种策略: 
+        a). 程序只用了一个EventLoop, 在这一个线程的一个EventLoop上同时处理accept新连接和旧连接数据的read/write
+        b). MultiEventLoops. 一个主IO线程的EventLoop用来处理新连接, 并且为每个新连接分配一个EventLoop, 
+         并在一个新的线程上运行这个EventLoop, 这个Eventloop可能管理多个连接 数据读写
+    */
+    EventLoop *acceptor = ch->getLoop();
+    EventLoop *newLoop = sharded_ ? acceptor : bases_->allocConnLoop(acceptor); // 由EventLoopBases的分配策略决定
+    if (newLoop == acceptor) {
+        addNewConn(newLoop, cfd, local, peer);
+    } else {
+        newLoop->pendingConns_++; // 连接加入之前也计入负载, 避免同一批连接都分配给同一个EventLoop
+        newLoop->safeCall([=] { // 在新连接自己的EventLoop上执行addcon任务
+            newLoop->pendingConns_--;
+            addNewConn(newLoop, cfd, local, peer);
+        });
+    }
+}
+
 void TcpServer::addNewConn(EventLoop *newLoop, int fd, Ip4Addr local, Ip4Addr peer) {
     TcpConnPtr con = createcb_();
+    if (edgeTriggered_) {
+        con->setEdgeTriggered(true);
+    }
+    con->setReadBudget(readBudget_, msgBudget_);
+    con->setCorked(corked_);
     con->attach(newLoop, fd, local, peer);
     if (statecb_) {
         con->setStateCallback(statecb_);
@@ -109,7 +278,7 @@ void TcpServer::addNewConn(EventLoop *newLoop, int fd, Ip4Addr local, Ip4Addr pe
         con->setReadCallback(readcb_);
     }
     if (codec_) {
-        con->codec_.reset(codec_.get());
+        con->codec_.reset(codec_->clone()); // 每个连接一个codec, 由连接释放
     }
 };
 
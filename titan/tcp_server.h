@@ -8,27 +8,75 @@ namespace titan {
  也可以给TcpServer一个独有的Eventloop, 然后按照round-robin方法给TcpConn从Eventloop池子中分配一个Eventloop
 */
 struct TcpServer : private noncopyable { // TcpServer融合了acceptor
+    /* 监听方式:
+        Single: 在一个EventLoop上监听, 按EventLoopBases的分配策略把新连接交给其他EventLoop
+        ReusePort: 每个EventLoop各自创建一个设置了SO_REUSEPORT的socket, 由内核分配连接
+        Exclusive: 所有EventLoop共享一个socket, 以EPOLLEXCLUSIVE加入各自的epoll, 每次只唤醒其中一个
+       后两种方式中连接由accept它的EventLoop处理, 没有跨线程的转交
+    */
+    enum ListenMode {
+        Single,
+        ReusePort,
+        Exclusive,
+    };
     TcpServer(EventLoopBases *bases);
-    ~TcpServer() { delete listen_channel_; }
+    ~TcpServer();
     // return 0 on sucess, errno on error
     int bind(const std::string &host, unsigned short port, bool reusePort = false);
+    int bind(const std::string &host, unsigned short port, ListenMode mode);
+    /* 使用已经在监听的socket, 例如从父进程继承的socket(见Prefork). 成功后fd由TcpServer持有, 析构时关闭.
+       Single: 在一个EventLoop上accept; Exclusive: fd复制到每个EventLoop, 以EPOLLEXCLUSIVE监听. 不支持ReusePort
+       return 0 on sucess, errno on error
+    */
+    int adopt(int fd, ListenMode mode = Single);
+    // 使用多个在监听的socket(例如旧进程以ReusePort方式监听的socket, 见HotRestart), 只有一个时与adopt(fds[0], mode)相同,
+    // 否则第i个socket在loopAt(i % loopCount())上accept. fds为空时返回EINVAL
+    int adopt(const std::vector<int> &fds, ListenMode mode = Single);
+    // 监听的socket, 多个Channel共享一个socket时只返回一次. 用于把socket交给其他进程
+    std::vector<int> listenFds();
+    // 停止accept并关闭本进程中的监听socket, 已经建立的连接不受影响. 可在任意线程调用
+    void stopAccept();
+    // 没有调用stopAccept时为true
+    bool accepting() { return !stopped_; }
     static TcpServerPtr startServer(EventLoopBases *bases, const std::string &host, unsigned short port, bool reusePort = false);
+    static TcpServerPtr startServer(EventLoopBases *bases, const std::string &host, unsigned short port, ListenMode mode);
     Ip4Addr getAddr() { return addr_; }
     EventLoop *getLoop() { return loop_; }
     void setTcpConnCreateCallback(const std::function<TcpConnPtr()> &cb) { createcb_ = cb; }
     void setTcpConnStateCallback(const TcpCallback &cb) { statecb_ = cb; }
     void setTcpConnReadCallback(const TcpCallback &cb) { assert(!readcb_); readcb_ = cb;}
     void setTcpConnMsgCallback(CodecBase *codec, const MsgCallback &cb); // 消息处理与setTcpConnReadCallback回调冲突，只能调用一个
+    // 新连接使用边沿触发, 见TcpConn::setEdgeTriggered
+    void setEdgeTriggered(bool edge) { edgeTriggered_ = edge; }
+    // 新连接合并发送, 见TcpConn::setCorked
+    void setCorked(bool corked) { corked_ = corked; }
+    // 新连接的读预算, 见TcpConn::setReadBudget
+    void setReadBudget(size_t bytes, int msgs = 0) {
+        readBudget_ = bytes;
+        msgBudget_ = msgs;
+    }
 
    private:
     EventLoop *loop_;
     EventLoopBases *bases_; // EventLoop or MultiEventLoops
     Ip4Addr addr_;
-    Channel *listen_channel_;
+    std::vector<Channel *> listen_channels_; // 每个监听的EventLoop一个
+    bool sharded_; // 每个EventLoop自己accept
+    bool sharedSocket_; // listen_channels_的fd指向同一个socket
+    std::atomic<bool> stopped_;
+    bool edgeTriggered_;
+    bool corked_;
+    size_t readBudget_;
+    int msgBudget_;
     std::function<TcpConnPtr()> createcb_; // 创建tcp连接时的callback
     TcpCallback statecb_, readcb_;
     std::unique_ptr<CodecBase> codec_;
-    void handleAccept();
+    int listenFd(bool reusePort); // 创建监听的socket, 失败返回-1
+    void addListener(EventLoop *loop, int fd, int events); // 在loop上accept fd
+    void closeListeners();
+    int checkListening(int fd, Ip4Addr *addr); // fd在监听时返回0, 否则返回errno
+    void handleAccept(Channel *ch);
+    void acceptConn(Channel *ch, int cfd); // 为accept得到的连接分配EventLoop
     void addNewConn(EventLoop *newLoop, int fd, Ip4Addr local, Ip4Addr peer);  // 为新的cfd关联一个TcpConn对象
 };
 
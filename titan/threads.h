@@ -1,11 +1,15 @@
 #pragma once
 #include <atomic>
 #include <condition_variable>
+#include <cstddef>
 #include <functional>
 #include <limits>
 #include <list>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <thread>
+#include <type_traits>
 #include <vector>
 #include "util.h"
 
@@ -35,9 +39,189 @@ struct SafeQueue : private std::mutex, private noncopyable {
     void wait_ready(std::unique_lock<std::mutex> &lk, int waitMs);
 };
 
-typedef std::function<void()> Task;
+/* 只能移动的void()可调用对象, 用于EventLoop的任务, 定时器和Channel回调. libstdc++的std::function只能内联16字节,
+   捕获一个TcpConnPtr和其他几个值的lambda每次都要分配内存. Task把不超过kInline字节并且移动时不抛异常的可调用对象
+   直接存放在内部, 更大的才分配在堆上. 不能复制, 需要保存多份时由调用者复制lambda本身
+*/
+class Task {
+   public:
+    static const size_t kInline = 64;
+    Task() noexcept : ops_(NULL) {}
+    Task(std::nullptr_t) noexcept : ops_(NULL) {}
+    template <class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    Task(F &&f) : ops_(NULL) {
+        typedef typename std::decay<F>::type Fn;
+        if (!isNull(f)) {
+            init<Fn>(std::forward<F>(f), std::integral_constant<bool, fitsInline<Fn>()>());
+        }
+    }
+    Task(Task &&o) noexcept : ops_(NULL) { take(o); }
+    Task &operator=(Task &&o) noexcept {
+        if (this != &o) {
+            reset();
+            take(o);
+        }
+        return *this;
+    }
+    Task &operator=(std::nullptr_t) noexcept {
+        reset();
+        return *this;
+    }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task() { reset(); }
+
+    void operator()() const {
+        if (ops_ == NULL) {
+            throw std::bad_function_call();
+        }
+        ops_->call(&buf_);
+    }
+    explicit operator bool() const noexcept { return ops_ != NULL; }
+
+   private:
+    typedef typename std::aligned_storage<kInline, alignof(std::max_align_t)>::type Storage;
+    struct Ops {
+        void (*call)(void *p);
+        void (*move)(void *from, void *to); // 移动到未初始化的to, 并析构from
+        void (*destroy)(void *p);
+    };
+    // 内联存放的可调用对象
+    template <class Fn>
+    struct Inline {
+        static void call(void *p) { (*static_cast<Fn *>(p))(); }
+        static void move(void *from, void *to) {
+            new (to) Fn(std::move(*static_cast<Fn *>(from)));
+            static_cast<Fn *>(from)->~Fn();
+        }
+        static void destroy(void *p) { static_cast<Fn *>(p)->~Fn(); }
+        static const Ops ops;
+    };
+    // 分配在堆上的可调用对象, buf_中只存放指针
+    template <class Fn>
+    struct Heap {
+        static Fn *&ptr(void *p) { return *static_cast<Fn **>(p); }
+        static void call(void *p) { (*ptr(p))(); }
+        static void move(void *from, void *to) { new (to) Fn *(ptr(from)); }
+        static void destroy(void *p) { delete ptr(p); }
+        static const Ops ops;
+    };
+    template <class Fn>
+    static constexpr bool fitsInline() {
+        return sizeof(Fn) <= kInline && alignof(Fn) <= alignof(Storage) && std::is_nothrow_move_constructible<Fn>::value;
+    }
+    template <class F>
+    static bool isNull(const F &) { return false; }
+    template <class R, class... Args>
+    static bool isNull(R (*f)(Args...)) { return f == NULL; }
+    template <class Sig>
+    static bool isNull(const std::function<Sig> &f) { return !f; }
+
+    template <class Fn, class F>
+    void init(F &&f, std::true_type) {
+        new (&buf_) Fn(std::forward<F>(f));
+        ops_ = &Inline<Fn>::ops;
+    }
+    template <class Fn, class F>
+    void init(F &&f, std::false_type) {
+        new (&buf_) Fn *(new Fn(std::forward<F>(f)));
+        ops_ = &Heap<Fn>::ops;
+    }
+    void take(Task &o) noexcept {
+        if (o.ops_) {
+            o.ops_->move(&o.buf_, &buf_);
+            ops_ = o.ops_;
+            o.ops_ = NULL;
+        }
+    }
+    void reset() noexcept {
+        if (ops_) {
+            ops_->destroy(&buf_);
+            ops_ = NULL;
+        }
+    }
+
+    mutable Storage buf_;
+    const Ops *ops_;
+};
+
+template <class Fn>
+const Task::Ops Task::Inline<Fn>::ops = {&Task::Inline<Fn>::call, &Task::Inline<Fn>::move, &Task::Inline<Fn>::destroy};
+template <class Fn>
+const Task::Ops Task::Heap<Fn>::ops = {&Task::Heap<Fn>::call, &Task::Heap<Fn>::move, &Task::Heap<Fn>::destroy};
+
 extern template class SafeQueue<Task>;
 
+/* 多生产者单消费者的无锁队列: 生产者用CAS把节点加入链表头部, 消费者用一次原子交换取走整个链表, 反转后按push的顺序处理.
+   消费者把处理完的节点按kChunk个一块放回空闲栈, 生产者每次从空闲栈取一块缓存在线程中, 稳定后push不分配内存.
+   空闲栈只有加入和整体取走(exchange)两种操作, 没有ABA问题: 生产者整体取走后留下第一块, 其余的放回
+*/
+template <typename T>
+struct MpscQueue : private noncopyable {
+    // 0 不限制队列中的元素数
+    MpscQueue(size_t capacity = 0) : head_(NULL), size_(0), capacity_(capacity), spare_(NULL), spareSize_(0) {}
+    ~MpscQueue();
+    //队列满则返回false, 可在任意线程调用
+    bool push(T &&v);
+    //取走当前所有元素, 按push的顺序对每个元素调用f, 返回元素个数. 只能在消费者线程调用, f中push的元素留给下一次drain
+    template <class F>
+    size_t drain(F &&f);
+    size_t size() { return size_.load(std::memory_order_relaxed); }
+    bool empty() { return head_.load(std::memory_order_relaxed) == NULL; }
+
+   private:
+    struct Node {
+        T value;
+        Node *next;
+        Node *nextChunk; // 空闲栈中每块的第一个节点指向下一块
+        size_t chunkSize;
+    };
+    static const size_t kChunk = 64; // 生产者每次取走的空闲节点数, 也是每个线程最多缓存的节点数
+    static const size_t kMaxSpare = 65536; // 空闲栈最多保留的节点数, 超过时释放
+    std::atomic<Node *> head_;
+    std::atomic<size_t> size_;
+    size_t capacity_;
+    std::atomic<Node *> spare_;
+    std::atomic<size_t> spareSize_;
+    Node *allocNode(); // 没有空闲节点时返回NULL
+    void pushChunks(Node *chunks, Node *last); // 把first到last的块放回空闲栈
+    // 当前线程缓存的空闲节点, 线程退出时释放. 同一类型的所有队列共用
+    static Node *&cachedNodes();
+    static void freeNodes(Node *n) {
+        while (n) {
+            Node *next = n->next;
+            delete n;
+            n = next;
+        }
+    }
+};
+
+/* 单生产者单消费者的有界环形队列, push只能在一个线程中调用, drain只能在另一个线程中调用.
+   生产者和消费者各自缓存对方的下标, 只在看起来满或者空时才读取对方的原子变量, 两边的数据放在不同的cache line
+*/
+template <typename T>
+struct SpscQueue : private noncopyable {
+    // 容量向上取整为2的幂
+    SpscQueue(size_t capacity);
+    //队列满则返回false, 此时v保持不变
+    bool push(T &&v);
+    //取走当前所有元素, 按push的顺序对每个元素调用f, 返回元素个数. f中push的元素留给下一次drain
+    template <class F>
+    size_t drain(F &&f);
+    bool empty() { return head_.load(std::memory_order_relaxed) == tail_.load(std::memory_order_acquire); }
+    size_t capacity() { return mask_ + 1; }
+
+   private:
+    std::unique_ptr<T[]> items_;
+    size_t mask_;
+    char pad0_[64];
+    std::atomic<size_t> tail_; // 生产者写入
+    size_t headCache_; // 生产者看到的head_
+    char pad1_[64];
+    std::atomic<size_t> head_; // 消费者写入
+    char pad2_[64];
+};
+
 struct ThreadPool : private noncopyable { // 管理任务队列SafeQueue和线程数组
     //创建线程池
     ThreadPool(int threads, int taskCapacity = 0, bool start = true);
@@ -51,7 +235,6 @@ struct ThreadPool : private noncopyable { // 管理任务队列SafeQueue和线
 
     //队列满返回false
     bool addTask(Task &&task);
-    bool addTask(Task &task) { return addTask(Task(task)); }
     size_t taskSize() { return tasks_.size(); }
 
    private:
@@ -110,6 +293,163 @@ bool SafeQueue<T>::pop_wait(T *v, int waitMs) {
     return true;
 }
 
+template <typename T>
+MpscQueue<T>::~MpscQueue() {
+    freeNodes(head_.load());
+    for (Node *c = spare_.load(); c;) {
+        Node *next = c->nextChunk;
+        freeNodes(c);
+        c = next;
+    }
+}
+
+template <typename T>
+typename MpscQueue<T>::Node *&MpscQueue<T>::cachedNodes() {
+    static thread_local Node *nodes = NULL; // 平凡类型, 下面的release析构之后仍然可以使用
+    static thread_local struct Release {
+        ~Release() {
+            freeNodes(nodes);
+            nodes = NULL;
+        }
+    } release;
+    (void) release;
+    return nodes;
+}
+
+template <typename T>
+typename MpscQueue<T>::Node *MpscQueue<T>::allocNode() {
+    Node *&cache = cachedNodes();
+    if (cache == NULL) {
+        Node *top = spare_.exchange(NULL, std::memory_order_acquire);
+        if (top == NULL) {
+            return NULL;
+        }
+        spareSize_.fetch_sub(top->chunkSize, std::memory_order_relaxed);
+        cache = top;
+        if (top->nextChunk) {
+            Node *last = top->nextChunk;
+            while (last->nextChunk) { // 只有在取走之后消费者又放回了节点时才需要多次查找
+                last = last->nextChunk;
+            }
+            pushChunks(top->nextChunk, last);
+        }
+    }
+    Node *n = cache;
+    cache = n->next;
+    return n;
+}
+
+template <typename T>
+void MpscQueue<T>::pushChunks(Node *chunks, Node *last) {
+    Node *old = spare_.load(std::memory_order_relaxed);
+    do {
+        last->nextChunk = old;
+    } while (!spare_.compare_exchange_weak(old, chunks, std::memory_order_release, std::memory_order_relaxed));
+}
+
+template <typename T>
+bool MpscQueue<T>::push(T &&v) {
+    size_t sz = size_.fetch_add(1, std::memory_order_relaxed); // 先占用名额, 超出容量时退回, 并发push不会超过capacity_
+    if (capacity_ && sz >= capacity_) {
+        size_.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+    Node *n = allocNode();
+    if (n) {
+        n->value = std::move(v);
+        n->next = head_.load(std::memory_order_relaxed);
+    } else {
+        n = new Node{std::move(v), head_.load(std::memory_order_relaxed), NULL, 0};
+    }
+    while (!head_.compare_exchange_weak(n->next, n, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    return true;
+}
+
+template <typename T>
+template <class F>
+size_t MpscQueue<T>::drain(F &&f) {
+    Node *n = head_.exchange(NULL, std::memory_order_acquire);
+    if (n == NULL) {
+        return 0;
+    }
+    Node *first = NULL;
+    while (n) { // 链表是后进先出的, 反转后按push的顺序处理
+        Node *next = n->next;
+        n->next = first;
+        first = n;
+        n = next;
+    }
+    size_t spare = spareSize_.load(std::memory_order_relaxed);
+    size_t room = spare < kMaxSpare ? kMaxSpare - spare : 0, c = 0;
+    Node *chunks = NULL, *lastChunk = NULL, *prev = NULL; // 前room个节点切成块放回空闲栈, 其余的释放
+    for (n = first; n; c++) {
+        Node *next = n->next;
+        T v(std::move(n->value)); // 执行前移出, 节点中不再保留捕获的对象
+        f(v);
+        if (c < room) {
+            if (c % kChunk == 0) {
+                if (prev) {
+                    prev->next = NULL; // 上一块结束
+                }
+                n->nextChunk = chunks;
+                n->chunkSize = 0;
+                chunks = n;
+                lastChunk = lastChunk ? lastChunk : n;
+            }
+            chunks->chunkSize++;
+            prev = n;
+        } else {
+            delete n;
+        }
+        n = next;
+    }
+    size_.fetch_sub(c, std::memory_order_relaxed);
+    if (chunks) {
+        prev->next = NULL;
+        spareSize_.fetch_add(std::min(c, room), std::memory_order_relaxed);
+        pushChunks(chunks, lastChunk);
+    }
+    return c;
+}
+
+template <typename T>
+SpscQueue<T>::SpscQueue(size_t capacity) : tail_(0), headCache_(0), head_(0) {
+    size_t cap = 1;
+    while (cap < capacity) {
+        cap <<= 1;
+    }
+    items_.reset(new T[cap]);
+    mask_ = cap - 1;
+}
+
+template <typename T>
+bool SpscQueue<T>::push(T &&v) {
+    size_t t = tail_.load(std::memory_order_relaxed);
+    if (t - headCache_ > mask_) {
+        headCache_ = head_.load(std::memory_order_acquire);
+        if (t - headCache_ > mask_) {
+            return false;
+        }
+    }
+    items_[t & mask_] = std::move(v);
+    tail_.store(t + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T>
+template <class F>
+size_t SpscQueue<T>::drain(F &&f) {
+    size_t h = head_.load(std::memory_order_relaxed);
+    size_t t = tail_.load(std::memory_order_acquire);
+    for (size_t i = h; i != t; i++) {
+        T v(std::move(items_[i & mask_])); // 执行前移出, 槽位中不再保留捕获的对象
+        f(v);
+    }
+    head_.store(t, std::memory_order_release);
+    return t - h;
+}
+
 template <typename T>
 T SafeQueue<T>::pop_wait(int waitMs) {
     std::unique_lock<std::mutex> lk(*this);
@@ -0,0 +1,267 @@
+#include "timer_wheel.h"
+#include <limits>
+#include "stats.h"
+
+namespace titan {
+
+static const int64_t kMaxDelta = (int64_t(1) << 32) - 1;
+
+static inline int ctz(uint64_t v) {
+    return __builtin_ctzll(v);
+}
+
+static inline uint64_t rotr(uint64_t v, int n) {
+    return n ? (v >> n) | (v << (64 - n)) : v;
+}
+
+TimerWheel::TimerWheel(int64_t now, int64_t tag) : now_(now), tag_(tag), count_(0), free_(NULL), firing_(0), firingAt_(0) {
+    for (int i = 0; i < kSlots; i++) {
+        slots_[i].prev = slots_[i].next = &slots_[i];
+    }
+    memset(bits_, 0, sizeof bits_);
+}
+
+TimerWheel::~TimerWheel() {}
+
+TimerNode *TimerWheel::alloc() {
+    if (free_ == NULL) { // 对象池为空, 分配一块新的节点
+        const uint32_t sz = 1 << kChunkBits;
+        uint32_t base = chunks_.size() * sz;
+        TimerNode *chunk = new TimerNode[sz];
+        chunks_.emplace_back(chunk);
+        for (uint32_t i = sz; i-- > 0;) {
+            chunk[i].index = base + i;
+            chunk[i].gen = 1;
+            chunk[i].slot = kFree;
+            chunk[i].next = free_;
+            free_ = &chunk[i];
+        }
+    }
+    TimerNode *n = free_;
+    free_ = (TimerNode *) n->next;
+    count_++;
+    return n;
+}
+
+void TimerWheel::release(TimerNode *n) {
+    n->cb = nullptr;
+    n->gen = (n->gen + 1) & kGenMask;
+    n->gen += n->gen == 0; // 句柄不能为0
+    n->slot = kFree;
+    n->next = free_;
+    free_ = n;
+    count_--;
+}
+
+int64_t TimerWheel::add(int64_t at, Task &&cb, int64_t interval) {
+    TimerNode *n = alloc();
+    n->at = at;
+    n->interval = interval;
+    n->cb = std::move(cb);
+    link(n);
+    return tag_ | int64_t(n->gen) << 32 | n->index;
+}
+
+TimerNode *TimerWheel::node(int64_t handle) {
+    uint32_t index = handle & 0xffffffff;
+    uint32_t gen = (handle >> 32) & kGenMask;
+    if ((handle >> 62) != (tag_ >> 62) || index >= chunks_.size() << kChunkBits) {
+        return NULL;
+    }
+    TimerNode *n = &chunks_[index >> kChunkBits][index & ((1 << kChunkBits) - 1)];
+    return n->gen != gen || n->slot == kFree ? NULL : n;
+}
+
+bool TimerWheel::cancel(int64_t handle) {
+    TimerNode *n = node(handle);
+    if (n == NULL) {
+        return false;
+    }
+    unlink(n); // 在槽中或者在expire摘下的链表中
+    release(n);
+    return true;
+}
+
+void TimerWheel::link(TimerNode *n) {
+    int64_t at = n->at < now_ ? now_ : n->at; // 已到期的定时器放到当前槽中
+    int64_t delta = at - now_;
+    int slot;
+    if (delta < kSlots0) {
+        slot = at & (kSlots0 - 1);
+    } else {
+        int level = 1;
+        int shift = kBits0;
+        while (level < kLevels - 1 && delta >= (int64_t(1) << (shift + kBitsN))) {
+            level++;
+            shift += kBitsN;
+        }
+        if (delta > kMaxDelta) { // 超过时间轮的范围, 先放在最高层, 在cascade时重新分配
+            at = now_ + kMaxDelta;
+        }
+        slot = kSlots0 + (level - 1) * kSlotsN + ((at >> shift) & (kSlotsN - 1));
+    }
+    TimerLink *head = &slots_[slot];
+    n->prev = head->prev;
+    n->next = head;
+    head->prev->next = n;
+    head->prev = n;
+    n->slot = slot;
+    bits_[slot >> 6] |= uint64_t(1) << (slot & 63);
+}
+
+void TimerWheel::unlink(TimerNode *n) {
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    int slot = n->slot;
+    if (slot >= 0 && slots_[slot].next == &slots_[slot]) {
+        bits_[slot >> 6] &= ~(uint64_t(1) << (slot & 63));
+    }
+    n->slot = kDetached;
+}
+
+// 把slot中的所有节点移到head链表上. 节点的slot字段保持不变, unlink时按槽是否为空维护位图, 结果同样正确
+void TimerWheel::detach(int slot, TimerLink *head) {
+    TimerLink *s = &slots_[slot];
+    if (s->next == s) {
+        head->prev = head->next = head;
+        return;
+    }
+    head->next = s->next;
+    head->prev = s->prev;
+    head->next->prev = head;
+    head->prev->next = head;
+    s->prev = s->next = s;
+    bits_[slot >> 6] &= ~(uint64_t(1) << (slot & 63));
+}
+
+// now_到达第0层的整圈时调用, 逐层把高层当前槽中的定时器重新分配到低层
+void TimerWheel::cascade() {
+    int shift = kBits0;
+    for (int level = 1; level < kLevels; level++, shift += kBitsN) {
+        int idx = (now_ >> shift) & (kSlotsN - 1);
+        TimerLink head;
+        detach(kSlots0 + (level - 1) * kSlotsN + idx, &head);
+        while (head.next != &head) {
+            TimerNode *n = (TimerNode *) head.next;
+            unlink(n);
+            link(n);
+        }
+        if (idx != 0) {
+            break;
+        }
+    }
+}
+
+int TimerWheel::firstSlot0(int from) const {
+    for (int w = from >> 6; w < kSlots0 / 64; w++) {
+        uint64_t b = bits_[w];
+        if (w == from >> 6) {
+            b &= ~uint64_t(0) << (from & 63);
+        }
+        if (b) {
+            return w * 64 + ctz(b);
+        }
+    }
+    return -1;
+}
+
+void TimerWheel::fire(TimerNode *n) {
+    firing_.store(tag_ | int64_t(n->gen) << 32 | n->index, std::memory_order_relaxed);
+    firingAt_.store(n->at, std::memory_order_relaxed);
+    if (n->interval) { // 重复定时器先计算下一次的到期时刻, 再执行任务
+        Task cb = std::move(n->cb);
+        uint32_t gen = n->gen;
+        n->at += n->interval;
+        link(n);
+        cb();
+        if (n->gen == gen) { // 任务中没有取消本定时器
+            n->cb = std::move(cb);
+        }
+    } else {
+        Task cb = std::move(n->cb);
+        release(n);
+        cb();
+    }
+    firing_.store(0, std::memory_order_relaxed);
+}
+
+void TimerWheel::expire(int64_t now, Histogram *lag, int64_t unit) {
+    const int64_t mask0 = kSlots0 - 1;
+    while (now_ <= now) {
+        if (count_ == 0) {
+            now_ = now + 1;
+            break;
+        }
+        if ((now_ & mask0) == 0) {
+            cascade();
+        }
+        int s = firstSlot0(now_ & mask0);
+        if (s < 0) { // 本圈剩余的槽都是空的, 直接跳到下一圈
+            now_ = std::min((now_ | mask0) + 1, now + 1);
+            continue;
+        }
+        int64_t t = (now_ & ~mask0) + s;
+        if (t > now) {
+            now_ = now + 1;
+            break;
+        }
+        // 先摘下整个槽并推进now_, 任务中新加入的已到期定时器会在下一个tick处理
+        TimerLink head;
+        detach(s, &head);
+        now_ = t + 1;
+        while (head.next != &head) {
+            TimerNode *n = (TimerNode *) head.next;
+            unlink(n);
+            if (lag) {
+                lag->add((now - n->at) * unit);
+            }
+            fire(n);
+        }
+    }
+}
+
+int64_t TimerWheel::nextExpire() const {
+    if (count_ == 0) {
+        return -1;
+    }
+    int64_t best = std::numeric_limits<int64_t>::max();
+    const int64_t mask0 = kSlots0 - 1;
+    int s = firstSlot0(now_ & mask0);
+    if (s >= 0) {
+        best = (now_ & ~mask0) + s;
+    } else if ((s = firstSlot0(0)) >= 0) { // 第0层中小于当前下标的槽属于下一圈
+        best = (now_ & ~mask0) + kSlots0 + s;
+    }
+    // 高层的槽只能给出cascade的时刻, 这个时刻不晚于槽中定时器的到期时刻
+    int shift = kBits0;
+    for (int level = 1; level < kLevels; level++, shift += kBitsN) {
+        uint64_t b = bits_[(kSlots0 + (level - 1) * kSlotsN) >> 6];
+        if (b == 0) {
+            continue;
+        }
+        int cur = (now_ >> shift) & (kSlotsN - 1);
+        uint64_t r = rotr(b, cur);
+        int k;
+        if (now_ & ((int64_t(1) << shift) - 1)) { // 当前槽已经cascade过, 再次处理要等一整圈
+            k = (r & ~uint64_t(1)) ? ctz(r & ~uint64_t(1)) : kSlotsN;
+        } else {
+            k = ctz(r);
+        }
+        best = std::min(best, ((now_ >> shift) + k) << shift);
+    }
+    return best;
+}
+
+void TimerWheel::clear() {
+    for (int i = 0; i < kSlots; i++) {
+        TimerLink *head = &slots_[i];
+        while (head->next != head) {
+            TimerNode *n = (TimerNode *) head->next;
+            Task cb(std::move(n->cb)); // 在节点释放之后析构, 析构时可能添加或取消定时器
+            unlink(n);
+            release(n);
+        }
+    }
+}
+
+}  // namespace titan
@@ -0,0 +1,82 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "titan-imp.h"
+
+namespace titan {
+
+struct Histogram;
+
+struct TimerLink {
+    TimerLink *prev, *next;
+};
+
+// 定时器节点, 由TimerWheel的对象池分配, 通过侵入式双向链表挂在时间轮的槽上
+struct TimerNode : public TimerLink {
+    int64_t at; // 到期时刻(tick)
+    int64_t interval; // 0表示一次性定时器
+    uint32_t index; // 在对象池中的下标
+    uint32_t gen; // 节点每回收一次加1, 用于识别已失效的句柄
+    int slot; // 所在槽的编号, kDetached表示正在执行, kFree表示空闲
+    Task cb;
+};
+
+/* 分层时间轮, 参考linux内核的定时器实现: 第0层256个槽, 精度为1个tick, 之后4层各64个槽,
+   每层的精度是上一层的一整圈. 插入和取消都是O(1), 低层转完一圈时把高层对应槽中的定时器重新分配到低层(cascade).
+   tick的单位由调用者决定, EventLoop中为毫秒, 高精度定时器为微秒.
+   句柄的格式为 tag | gen << 32 | index, tag用于区分同一个EventLoop中的多个时间轮.
+*/
+struct TimerWheel : private noncopyable {
+    TimerWheel(int64_t now, int64_t tag = 0);
+    ~TimerWheel();
+    // 添加定时器, 返回用于取消的句柄(非0). interval=0表示一次性定时器, 否则每interval个tick执行一次
+    int64_t add(int64_t at, Task &&cb, int64_t interval = 0);
+    // 取消定时器, 句柄无效或者一次性定时器已执行返回false
+    bool cancel(int64_t handle);
+    // 定时器还没有执行完(包括重复定时器)
+    bool pending(int64_t handle) { return node(handle) != NULL; }
+    // 执行所有at <= now的定时器. lag不为NULL时记录每个定时器的延迟(now - at) * unit
+    void expire(int64_t now, Histogram *lag = NULL, int64_t unit = 1);
+    // 最早需要处理的时刻, 不会晚于最早的定时器到期时刻. 无定时器时返回-1
+    int64_t nextExpire() const;
+    size_t size() const { return count_; }
+    void clear();
+    // 正在执行的定时器的句柄和到期时刻, 没有时句柄为0. 供Watchdog在其他线程读取
+    int64_t firing() const { return firing_.load(std::memory_order_relaxed); }
+    int64_t firingAt() const { return firingAt_.load(std::memory_order_relaxed); }
+
+   private:
+    static const int kBits0 = 8;
+    static const int kBitsN = 6;
+    static const int kLevels = 5;
+    static const int kSlots0 = 1 << kBits0;
+    static const int kSlotsN = 1 << kBitsN;
+    static const int kSlots = kSlots0 + (kLevels - 1) * kSlotsN;
+    static const int kChunkBits = 10;
+    static const int kDetached = -1;
+    static const int kFree = -2;
+    static const uint32_t kGenMask = 0x3fffffff; // 句柄的第62, 63位留给tag
+
+    int64_t now_; // 下一个待处理的tick
+    int64_t tag_;
+    size_t count_;
+    TimerLink slots_[kSlots];
+    uint64_t bits_[kSlots / 64]; // 非空槽的位图
+    std::vector<std::unique_ptr<TimerNode[]>> chunks_; // 对象池, 每块1 << kChunkBits个节点
+    TimerNode *free_;
+    std::atomic<int64_t> firing_, firingAt_;
+
+    TimerNode *node(int64_t handle); // 句柄对应的有效节点, 无效返回NULL
+    TimerNode *alloc();
+    void release(TimerNode *n);
+    void link(TimerNode *n);
+    void unlink(TimerNode *n);
+    void detach(int slot, TimerLink *head);
+    void cascade();
+    void fire(TimerNode *n);
+    int firstSlot0(int from) const;
+};
+
+}  // namespace titan
@@ -1,6 +1,9 @@
 #include "file.h"
+#include "hot_restart.h"
 #include "http.h"
 #include "logging.h"
+#include "prefork.h"
 #include "slice.h"
 #include "threads.h"
 #include "util.h"
+#include "watchdog.h"
@@ -0,0 +1,171 @@
+#include "watchdog.h"
+#include <execinfo.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "logging.h"
+
+namespace titan {
+
+namespace {
+
+// 信号处理函数把调用栈写到这里, 同一时刻只获取一个线程的调用栈
+std::mutex captureMutex;
+const int kMaxFrames = 48;
+void *frames[kMaxFrames];
+std::atomic<int> depth(-1);
+
+void onCaptureSignal(int) {
+    int saved = errno;
+    depth.store(backtrace(frames, kMaxFrames), std::memory_order_release);
+    errno = saved;
+}
+
+}  // namespace
+
+Watchdog::Watchdog(int64_t thresholdMs, int signo) : threshold_(thresholdMs * 1000), signo_(signo), stalls_(0), stop_(false) {}
+
+Watchdog &Watchdog::watch(EventLoop *loop) {
+    loops_.push_back(Watched{loop, 0, 0});
+    return *this;
+}
+
+Watchdog &Watchdog::watch(MultiEventLoops *loops) {
+    for (int i = 0; i < loops->size(); i++) {
+        watch(&loops->getLoop(i));
+    }
+    return *this;
+}
+
+void Watchdog::start() {
+    void *warm[1];
+    backtrace(warm, 1); // 第一次调用会加载libgcc并分配内存, 不能发生在信号处理函数中
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = onCaptureSignal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    int r = sigaction(signo_, &sa, NULL);
+    fatalif(r, "sigaction %d failed %d(%s)", signo_, errno, strerror(errno));
+    stop_ = false;
+    thread_ = std::thread([this] { run(); });
+}
+
+void Watchdog::stop() {
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void Watchdog::run() {
+    int64_t interval = std::max(threshold_ / 4, int64_t(1000)); // 卡顿最晚在1.25倍阈值时被发现
+    std::unique_lock<std::mutex> lk(mutex_);
+    while (!stop_) {
+        cond_.wait_for(lk, std::chrono::microseconds(interval));
+        if (stop_) {
+            break;
+        }
+        lk.unlock();
+        int64_t now = util::steadyMicro();
+        for (size_t i = 0; i < loops_.size(); i++) {
+            check(i, now);
+        }
+        lk.lock();
+    }
+}
+
+void Watchdog::check(size_t i, int64_t now) {
+    Watched &w = loops_[i];
+    int64_t since = w.loop->busySince();
+    if (w.reported && since != w.reported) {
+        warn("event loop %zu recovered after stalling at least %lld ms", i, (long long) (w.lastSeen - w.reported) / 1000);
+        w.reported = 0;
+    }
+    if (since == 0 || now - since < threshold_ || w.loop->thread_.load() == pthread_t()) { // 未运行或已退出的循环不检测
+        return;
+    }
+    if (w.reported == since) {
+        w.lastSeen = now;
+        return;
+    }
+    std::string what = describe(w.loop);
+    std::string stack = backtraceOf(w.loop);
+    if (w.loop->busySince() != since) { // 获取调用栈期间已经恢复, 调用栈不再对应卡顿
+        return;
+    }
+    stalls_++;
+    w.reported = since;
+    w.lastSeen = now;
+    warn("event loop %zu stalled for %lld ms in %s\n%s", i, (long long) (now - since) / 1000, what.c_str(), stack.c_str());
+}
+
+std::string Watchdog::describe(EventLoop *loop) {
+    int running = loop->running_.load(std::memory_order_relaxed);
+    int64_t id = loop->runningId_.load(std::memory_order_relaxed);
+    int fd = loop->runningFd_.load(std::memory_order_relaxed);
+    switch (running) {
+        case EventLoop::RunRead:
+        case EventLoop::RunWrite: {
+            std::string r = util::format("%s callback of channel %lld fd %d", running == EventLoop::RunRead ? "read" : "write", (long long) id, fd);
+            struct sockaddr_in peer;
+            socklen_t len = sizeof peer;
+            if (getpeername(fd, (struct sockaddr *) &peer, &len) == 0 && peer.sin_family == AF_INET) { // fd可能已被关闭或者复用, 只作参考
+                r += " peer " + Ip4Addr(peer).toString();
+            }
+            return r;
+        }
+        case EventLoop::RunTimer:
+        case EventLoop::RunHighResTimer: {
+            TimerWheel *wheel = running == EventLoop::RunTimer ? &loop->timers_ : loop->hrTimers_;
+            int64_t handle = wheel->firing();
+            if (handle == 0) {
+                return "timer processing";
+            }
+            return util::format("%s timer handle %lld due at %lld", running == EventLoop::RunTimer ? "ms" : "high resolution", (long long) handle,
+                                (long long) wheel->firingAt());
+        }
+        case EventLoop::RunTask:
+            return util::format("task queued %lld us before this iteration", (long long) (loop->busySince() - id));
+        case EventLoop::RunMailbox:
+            return util::format("mailbox messages from shard %lld", (long long) id);
+        default:
+            return "event loop internals";
+    }
+}
+
+std::string Watchdog::backtraceOf(EventLoop *loop) {
+    std::lock_guard<std::mutex> lk(captureMutex);
+    // 先登记再读取thread_, loop()清空thread_后会等待登记归零, 保证不会向已退出的线程发送信号
+    loop->capturing_++;
+    ExitCaller release([loop] { loop->capturing_--; });
+    pthread_t th = loop->thread_.load();
+    if (th == pthread_t()) {
+        return "backtrace unavailable: event loop not running";
+    }
+    depth.store(-1, std::memory_order_relaxed);
+    int r = pthread_kill(th, signo_);
+    if (r) {
+        return util::format("backtrace unavailable: pthread_kill %d(%s)", r, strerror(r));
+    }
+    int n = -1;
+    for (int i = 0; i < 200 && n < 0; i++) { // 最多等待200ms
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        n = depth.load(std::memory_order_acquire);
+    }
+    if (n < 0) {
+        return "backtrace unavailable: signal not handled";
+    }
+    char **syms = backtrace_symbols(frames, n);
+    std::string out = "backtrace:";
+    for (int i = 1; i < n; i++) { // 第0层是信号处理函数
+        out += util::format("\n  #%d %s", i - 1, syms ? syms[i] : "?");
+    }
+    free(syms);
+    return out;
+}
+
+}  // namespace titan
@@ -0,0 +1,50 @@
+#pragma once
+#include <signal.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "event_loop.h"
+
+namespace titan {
+
+/* 检测EventLoop的卡顿: 后台线程定期检查每个EventLoop本次循环开始执行回调的时刻, 回调执行超过thresholdMs时
+   通过Logger记录正在执行的channel(fd以及对端地址)/定时器/任务, 以及IO线程的调用栈. 调用栈由发给IO线程的signo信号
+   在信号处理函数中用backtrace获取, 链接时加上-rdynamic才能显示函数名. 信号可能使卡住的回调中的阻塞系统调用返回EINTR.
+   每次卡顿只记录一次, 恢复之后再记录一条持续时间
+
+    Watchdog wd(100);
+    wd.watch(&loops);
+    wd.start();
+*/
+struct Watchdog : private noncopyable {
+    Watchdog(int64_t thresholdMs, int signo = SIGRTMIN + 1);
+    ~Watchdog() { stop(); }
+    // 需要在start()之前调用
+    Watchdog &watch(EventLoop *loop);
+    Watchdog &watch(MultiEventLoops *loops);
+    void start();
+    void stop();
+    // 检测到的卡顿次数
+    size_t stalls() { return stalls_; }
+
+   private:
+    struct Watched {
+        EventLoop *loop;
+        int64_t reported; // 已记录的卡顿的busySince(), 0表示没有
+        int64_t lastSeen; // 最后一次看到卡顿仍在继续的时刻
+    };
+    int64_t threshold_; // 微秒
+    int signo_;
+    std::vector<Watched> loops_;
+    std::atomic<size_t> stalls_;
+    bool stop_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::thread thread_;
+    void run();
+    void check(size_t i, int64_t now);
+    std::string describe(EventLoop *loop);
+    std::string backtraceOf(EventLoop *loop);
+};
+
+}  // namespace titan